@@ -0,0 +1,103 @@
+/* Non-blocking per-connection state machine for the multiplexing strategies */
+
+#ifndef CONN_UTIL_H
+#define CONN_UTIL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "file_util.h"
+#include "pool_util.h"
+
+/* Requests a binary connection may have in progress before it stops reading */
+#define MAX_PIPELINE 64
+
+/* Where a connection is in the command/filename/file-transfer exchange */
+enum ConnState
+{
+    CONN_READ_CMD,     // Text protocol: receiving the BUF_SIZE frame holding "kmeans ..." or "matinv ..."
+    CONN_READ_SIZE,    // Text protocol: receiving the BUF_SIZE frame holding the input file size
+    CONN_READ_HDR,     // Binary protocol: receiving a frame header
+    CONN_READ_PAYLOAD, // Binary protocol: receiving the command in the frame payload
+    CONN_READ_FILE,    // Receiving the input file
+    CONN_SKIP_FILE,    // Binary protocol: discarding an input file too large to accept
+    CONN_BUSY          // Text protocol: one request at a time, wait until its result is sent
+};
+
+/* Return values of conn_read() and conn_write() */
+#define CONN_OK 0     // Nothing more to do until the socket is ready again
+#define CONN_JOB 1    // A job is ready, submit the returned request's `job`
+#define CONN_READY 2  // A result was sent, call conn_read() for the next command
+#define CONN_CLOSE -1 // Drop the connection
+
+struct conn;
+
+/* One command of a connection, from its arrival until its result is sent */
+struct request
+{
+    struct conn *conn;
+    uint32_t job_id;         // Binary protocol: job id of the request
+    char cmd[7];             // "kmeans" or "matinv"
+    char command[PATH_SIZE]; // Command line as sent by the client
+    char solution[32];       // Solution filename
+    const char *error;       // Send this error instead of a result
+
+    char *input; // Uploaded input, NULL if none
+    size_t input_len;
+
+    // The result, in `result` or spliced from pipe `result_fd`
+    char *result;
+    size_t result_len;
+    int result_fd;           // Output pipe of the job's child process (muxbasic), -1 if none
+    int pipe_empty;          // Splicing waits for the child to write more
+    int pipe_watched;        // The event loop watches `result_fd` for more output
+    struct timespec sent_at; // When the result started to go out, for the log
+
+    struct job job;
+    struct request *next; // Link in the connection's send queue
+};
+
+struct conn
+{
+    int fd;
+    int client_num, solution_num;
+    char *cwd;
+    enum ConnState state;
+    int binary;        // Binary frames (proto_util.h) instead of the text protocol
+    int eof;           // The client sent everything it will, close once all is answered
+    int dead;          // Socket closed, free once no job refers to it
+    struct conn *next; // Link in the event loop's list of dead connections
+
+    // Request being received: command or size frame or frame header, command and input file
+    struct request *req;
+    char frame[BUF_SIZE];
+    size_t frame_len;
+    uint32_t payload_len;
+    uint64_t remain;
+
+    int pending; // Requests received but not answered yet
+    int jobs;    // Requests handed to a worker or watched by the event loop
+
+    // Pending outgoing frames (filename, file size, frame headers)
+    char out[2 * BUF_SIZE];
+    size_t out_len, out_off;
+    int close_after_send;
+
+    // Finished requests, answered in this order. `head` is being sent.
+    struct request *head, *tail;
+    size_t result_off;
+    int sending;
+};
+
+/* Functions */
+
+struct conn *conn_new(int fd, int client_num, char cwd[], int binary);
+void conn_free(struct conn *c);
+void request_free(struct request *r);
+int conn_read(struct conn *c, struct request **job);
+int conn_write(struct conn *c);
+int conn_wants_read(struct conn *c);
+int conn_wants_write(struct conn *c);
+int conn_read_result_size(struct request *r);
+void conn_job_done(struct request *r);
+
+#endif // CONN_UTIL_H
@@ -3,16 +3,26 @@
 #ifndef FILE_UTIL_H
 #define FILE_UTIL_H
 
+#include <sys/types.h> // size_t, off_t
+#include <time.h>      // struct timespec
+
 /* Constant sizes */
 
 #define PATH_SIZE 1024
 #define BUF_SIZE 256
+#define CHUNK_SIZE (64 * 1024) // Bulk transfers
 
 /* Functions */
 
 void recv_file(int sd, char filename[]);
 void send_file(int sd, char filename[]);
+int send_file_data(int sd, int fd, off_t size);
+int pipe_data(int fd, const char *data, size_t len);
+void log_transfer(const char name[], size_t bytes, const struct timespec *start);
+char *recv_data(int sd, size_t *len);
+void send_data(int sd, char data[], size_t len);
 void parse_command(int sd, char command[]);
 int has_f_flag(char command[]);
+int f_flag_path(char command[], char path[]);
 
 #endif // FILE_UTIL_H
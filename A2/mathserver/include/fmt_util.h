@@ -0,0 +1,19 @@
+/* Fast number formatting for results (libmathkern) */
+
+#ifndef FMT_UTIL_H
+#define FMT_UTIL_H
+
+/* Longest output of fmt_double(), without the terminating NUL */
+#define FMT_DOUBLE_MAX 24
+/* Longest output of fmt_fixed2(), without the terminating NUL: -FLT_MAX */
+#define FMT_FIXED2_MAX 43
+/* Longest output of fmt_int(), without the terminating NUL */
+#define FMT_INT_MAX 11
+
+/* Functions */
+
+int fmt_double(char *buf, double v);
+int fmt_fixed2(char *buf, float v);
+int fmt_int(char *buf, int v);
+
+#endif // FMT_UTIL_H
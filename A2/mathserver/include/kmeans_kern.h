@@ -0,0 +1,111 @@
+/* Kmeans clustering kernel (libmathkern), used by kmeans-par.c and server.c */
+
+#ifndef KMEANS_KERN_H
+#define KMEANS_KERN_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define MAX_POINTS 4096 * 4096
+#define MAX_CLUSTERS 32 * 32
+#define MAX_DIMS 1024
+#define KMEANS_THREADS 16
+
+/* Binary dataset file (kmeans -f, kmeans-convert), every field little-endian:
+ *    0  char[4]  magic "KMDS"
+ *    4  u32      version, 1
+ *    8  u64      N, the number of points
+ *   16  u32      D, the dimensions of a point
+ *   20  u32      flags, KMEANS_FILE_CHECKSUM if the checksum is set
+ *   24  u64      checksum, FNV-1a (64 bits) of the bytes of the columns
+ *   32  reserved up to KMEANS_FILE_HDR, 0
+ *   64  D columns of N float32 (IEEE 754): coordinate d of point i is
+ *       element d * N + i, the layout of struct kmeans, so that
+ *       kmeans_load_file() can map the columns instead of reading them */
+#define KMEANS_FILE_MAGIC "KMDS"
+#define KMEANS_FILE_VERSION 1
+#define KMEANS_FILE_HDR 64
+#define KMEANS_FILE_CHECKSUM 1
+
+#define KMEANS_LLOYD 0   // Every point against every centroid, every iteration
+#define KMEANS_HAMERLY 1 // One upper and one lower bound per point
+#define KMEANS_ELKAN 2   // One upper and k lower bounds per point
+#define KMEANS_ELKAN_MAX (1 << 27) // Most bounds (N * k) Elkan keeps, else Hamerly is used
+
+#define KMEANS_INIT_RANDOM 0   // k random points, as srand(0); rand() picks them
+#define KMEANS_INIT_PLUSPLUS 1 // kmeans++: each next centroid a point drawn by its squared distance to the others
+#define KMEANS_INIT_PARALLEL 2 // kmeans||: a few rounds drawing many points at once, then kmeans++ on those
+#define KMEANS_SEED 0x5eedULL  // kmeans++ and kmeans|| draws depend only on this, the round and the point
+#define KMEANS_PAR_ROUNDS 5    // kmeans|| rounds, each drawing about 2k points
+
+#define KMEANS_STREAM_BUF (1 << 22) // Bytes of text kmeans_stream() reads at a time, more only for a longer line
+
+// One iteration of kmeans_cluster(), traced
+struct kmeans_iter
+{
+    int changed;    // Points that changed cluster
+    double shift;   // Squared moves of the centroids, summed
+    double inertia; // Squared distances of the points to the centroids they were assigned, summed
+    double seconds; // Wall time
+};
+
+/* One clustering problem. Nothing is shared between two of these, so
+ * several can be solved at the same time in one process. The points
+ * are stored one dimension after the other, so that the nearest-centroid
+ * search can load several of them at once (kmeans_simd.h). */
+struct kmeans
+{
+    int N;           // Number of entries in the data
+    int D;           // Dimensions of a point, from the first line of the data
+    int k;           // Number of centroids
+    int cap;         // Allocated points: coordinate d of point i is coords[d * cap + i]
+    float *coords;   // The coordinates of the points
+    void *map;       // The dataset file mapping coords points into, NULL if they are malloc'd
+    size_t map_len;
+    int *assign;     // The cluster that each point belongs to
+    float *centroid; // Coordinate d of cluster center (also called centroid) c is centroid[c * D + d]
+    int algorithm;  // KMEANS_*, set before kmeans_cluster()
+    int iterations; // Iterations taken by kmeans_cluster()
+    long long distances; // Point-centroid distances computed by kmeans_cluster()
+    double tol;     // Tolerance to stop at (kmeans_cluster()), 0: once no point changes cluster
+    int max_iter;   // Most iterations, 0: no limit
+    int traced;     // Record each iteration of kmeans_cluster() in trace
+    struct kmeans_iter *trace;
+    int trace_len;
+    int *cpus;      // kmeans_place(): worker i runs on cpus[i % ncpus], NULL: not pinned
+    int ncpus;
+};
+
+struct kmeans_options
+{
+    int k;
+    char *input_path;
+    char *results_path;
+    char *cpus; // CPU list to pin the workers to, NULL: not pinned
+    int algorithm; // KMEANS_*
+    int init;      // KMEANS_INIT_*
+    int batch;     // Mini-batch size for kmeans_stream(), 0: the whole input in memory
+    int passes;    // kmeans_stream(): passes over the input updating the centroids
+    double tol;    // See struct kmeans
+    int max_iter;
+    char *trace_path; // Where to write the iterations as JSON, NULL: nowhere
+    int assignments;  // Write only the cluster of each point
+};
+
+/* Functions */
+
+void kmeans_default_options(struct kmeans_options *opt);
+int kmeans_read_options(struct kmeans_options *opt, int argc, char *argv[]);
+int kmeans_load(struct kmeans *km, const char *buf, size_t len, int k);
+int kmeans_load_file(struct kmeans *km, const char *path, int k);
+int kmeans_save(struct kmeans *km, FILE *fp, int checksum);
+int kmeans_place(struct kmeans *km, const char *cpus, FILE *out);
+int kmeans_seed(struct kmeans *km, int init);
+int kmeans_cluster(struct kmeans *km);
+int kmeans_write(struct kmeans *km, FILE *fp, int assignments);
+int kmeans_write_file(struct kmeans *km, const char *path, int assignments);
+void kmeans_write_trace(struct kmeans *km, FILE *fp);
+int kmeans_stream(struct kmeans *km, int fd, const char *buf, size_t len, const struct kmeans_options *opt, FILE *out);
+void kmeans_free(struct kmeans *km);
+
+#endif // KMEANS_KERN_H
@@ -0,0 +1,45 @@
+/* Vectorized nearest-centroid search of the kmeans kernel (libmathkern) */
+
+#ifndef KMEANS_SIMD_H
+#define KMEANS_SIMD_H
+
+#include <stddef.h>
+
+/* Dimensions with a search of their own, with the loop over the
+ * dimensions unrolled: KMEANS_FIXED_DIMS[i] for fixed[i] below */
+#define KMEANS_FIXED_DIMS {2, 3, 4, 8, 16, 32, 64}
+#define KMEANS_NFIXED 7
+
+/* near[i] = the centroid closest to point i for 0 <= i < n, the last
+ * one on ties, like `dist <= min_dist` in a scan over the k centroids.
+ * Coordinate d of point i is x[d * stride + i], coordinate d of centroid
+ * c is centroid[c * D + d]. */
+typedef void (*kmeans_nearest_fn)(const float *x, size_t stride, int n, int D, const float *centroid, int k,
+                                  int *near);
+
+/* dist[c] = the squared distance of the point at x (coordinate d at
+ * x[d * stride]) to centroid c for 0 <= c < k, to the bit as the searches
+ * compute it. Coordinate d of centroid c is centroid_t[d * k + c]: the
+ * centroids transposed, so that a register holds several of them. */
+typedef void (*kmeans_dists_fn)(const float *x, size_t stride, int D, const float *centroid_t, int k,
+                                float *dist);
+
+/* One implementation of the search. The best one the CPU supports is
+ * picked once per process, see kmeans_simd(). All of them compute the
+ * distances in float, in the same order, so they agree to the bit. */
+struct kmeans_simd
+{
+    const char *name; // "avx512", "avx2" or "generic"
+
+    kmeans_nearest_fn nearest;               // Any D
+    kmeans_nearest_fn fixed[KMEANS_NFIXED]; // Only for D = KMEANS_FIXED_DIMS[i]
+    kmeans_dists_fn dists;                   // One point, all centroids (Hamerly, Elkan)
+};
+
+/* Functions */
+
+const struct kmeans_simd *kmeans_simd(void);
+kmeans_nearest_fn kmeans_nearest(int D);
+float kmeans_dist(const float *x, size_t stride, int D, const float *m);
+
+#endif // KMEANS_SIMD_H
@@ -0,0 +1,89 @@
+/* Matrix inverse kernel (libmathkern), used by matinv-par.c and server.c */
+
+#ifndef MATINV_KERN_H
+#define MATINV_KERN_H
+
+#include <stdio.h>
+
+#define MAX_SIZE 65536 // Largest N accepted: two 32 GiB matrices
+#define MATINV_ALIGN 64 // Every matrix row starts on a cache line
+#define MATINV_BLOCK 64 // Pivots per panel of the blocked algorithm
+#define MATINV_TILE 256 // Columns per tile of its rank-k update
+
+/* Binary matrix file (matinv -f), every field little-endian:
+ *    0  char[4]  magic "MINV"
+ *    4  u32      version, 1
+ *    8  u64      N
+ *   16  u32      element type, MATINV_F64 (IEEE 754 double)
+ *   20  u32      layout, MATINV_ROW_MAJOR or MATINV_COL_MAJOR
+ *   24  u64      reserved, 0
+ *   32  the N * N elements */
+#define MATINV_FILE_MAGIC "MINV"
+#define MATINV_FILE_VERSION 1
+#define MATINV_FILE_HDR 32
+#define MATINV_F64 1
+#define MATINV_ROW_MAJOR 0
+#define MATINV_COL_MAJOR 1
+
+/* How matinv_print() writes a matrix */
+#define MATINV_OUT_TEXT 0   // " %5.2f" per element, like matrix_inverse.c
+#define MATINV_OUT_EXACT 1  // Shortest decimals that read back exactly (fmt_util.h)
+#define MATINV_OUT_BINARY 2 // A matrix file in the format above, nothing else
+
+struct matinv_simd;
+
+/* One inversion problem. The matrices are allocated per problem and only
+ * as large as N needs, so several can be solved at the same time in one
+ * process. Row `row` of A starts at A + row * ld. */
+struct matinv
+{
+    int N;       // matrix size
+    int threads; // worker threads
+    int blocked; // use the blocked algorithm
+    int format;  // MATINV_OUT_*
+    const struct matinv_simd *simd; // row operations for this CPU
+    size_t ld;    // distance between rows in doubles: N rounded up to a cache line
+    size_t bytes; // size of the mapping behind each matrix
+    double *A;    // matrix A
+    double *I;    // the A inverse matrix, which will be initialized to the identity matrix
+
+    // Partial pivoting swaps no rows: row p of the inverse is row perm[p] of I
+    int *perm;
+    int *cpus;  // --cpus: worker i runs on cpus[i % ncpus] and touches its rows first, NULL: not pinned
+    int ncpus;
+    int singular;  // A turned out singular to working precision
+    int error;     // Why the inversion could not run (an errno), 0 if it ran
+    double anorm;  // 1-norm of A, for the condition number
+    double *check; // A * (1, ..., 1), to measure the residual of the inverse
+};
+
+struct matinv_options
+{
+    int N;           // matrix size
+    int PRINT;       // print switch
+    int maxnum;      // max number of element
+    char *Init;      // matrix init type
+    int threads;     // worker threads
+    char *algorithm; // "basic" or "blocked"
+    int verbose;     // report the SIMD kernel
+    int hugepages;   // back the matrices with huge pages
+    double maxcond;  // reject inverses with a larger condition number, 0: no limit
+    char *input_path; // matrix file to invert instead of generating one
+    int format;       // MATINV_OUT_*
+    char *cpus;       // CPU list to pin the workers to, NULL: not pinned
+};
+
+/* Functions */
+
+void matinv_default_options(struct matinv_options *opt);
+int matinv_read_options(struct matinv_options *opt, int argc, char *argv[], FILE *out);
+int matinv_init(struct matinv *m, struct matinv_options *opt, FILE *out);
+int matinv_load(struct matinv *m, struct matinv_options *opt, const char *buf, size_t len, FILE *out);
+int matinv_load_file(struct matinv *m, struct matinv_options *opt, const char *path, FILE *out);
+int matinv_invert(struct matinv *m);
+int matinv_report(struct matinv *m, struct matinv_options *opt, FILE *out);
+double *matinv_row(struct matinv *m, double *M, int row);
+void matinv_print(struct matinv *m, double *M, char name[], FILE *out);
+void matinv_free(struct matinv *m);
+
+#endif // MATINV_KERN_H
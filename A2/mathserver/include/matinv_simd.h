@@ -0,0 +1,24 @@
+/* Vectorized row operations of the matrix inverse kernel (libmathkern) */
+
+#ifndef MATINV_SIMD_H
+#define MATINV_SIMD_H
+
+/* One implementation of the row operations. The best one the CPU
+ * supports is picked once per process, see matinv_simd(). */
+struct matinv_simd
+{
+    const char *name; // "avx512", "avx2", "sse2" or "generic"
+
+    // y[j] -= a * x[j] for 0 <= j < n: the elimination step
+    void (*eliminate)(double *restrict y, const double *restrict x, double a, int n);
+
+    // y[j] += w[0] * r0[j] + w[1] * r1[j] + w[2] * r2[j] + w[3] * r3[j]: the rank-k update, four rows at a time
+    void (*update4)(double *restrict y, const double w[4], const double *r0, const double *r1,
+                    const double *r2, const double *r3, int n);
+};
+
+/* Functions */
+
+const struct matinv_simd *matinv_simd(void);
+
+#endif // MATINV_SIMD_H
@@ -0,0 +1,24 @@
+/* Thread pinning and NUMA memory placement for the kernels (libmathkern).
+ * Needs _GNU_SOURCE, for cpu_set_t. */
+
+#ifndef NUMA_UTIL_H
+#define NUMA_UTIL_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define NUMA_MAX_CPUS CPU_SETSIZE
+#define NUMA_MAX_NODES 64
+#define NUMA_SAMPLE_PAGES 4096 // Pages looked at by numa_report()
+
+/* Functions */
+
+int cpulist_parse(const char *list, int **cpus);
+int pin_attr(pthread_attr_t *attr, int cpu);
+int pin_self(int cpu, cpu_set_t *saved);
+void unpin_self(const cpu_set_t *saved);
+void numa_report(FILE *out, const char *name, const void *addr, size_t bytes);
+
+#endif // NUMA_UTIL_H
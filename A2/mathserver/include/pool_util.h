@@ -0,0 +1,36 @@
+/* Fixed pool of compute worker threads for server.c */
+
+#ifndef POOL_UTIL_H
+#define POOL_UTIL_H
+
+#include <pthread.h>
+
+/* A unit of work. `run` is called on a worker thread, the job is then
+ * handed back to the event loop through `pool_take_done`. */
+struct job
+{
+    void (*run)(struct job *job);
+    void *arg;          // Owner of the job (e.g. a connection)
+    struct job *next;
+};
+
+struct pool
+{
+    pthread_t *threads;
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct job *head, *tail; // Jobs waiting for a worker
+    struct job *done;        // Finished jobs waiting for the event loop
+    int event_fd;            // Readable when `done` is non-empty
+    int stop;
+};
+
+/* Functions */
+
+void pool_init(struct pool *pool, int nthreads);
+void pool_submit(struct pool *pool, struct job *job);
+struct job *pool_take_done(struct pool *pool);
+void pool_destroy(struct pool *pool);
+
+#endif // POOL_UTIL_H
@@ -0,0 +1,50 @@
+/* Binary wire protocol shared by client.c and server.c */
+
+#ifndef PROTO_UTIL_H
+#define PROTO_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Every message is a FRAME_HDR_SIZE header, followed by `payload_len` bytes of
+ * payload (a command, a solution filename or an error message) and `size`
+ * bytes of data (an input file or a result). All fields are big-endian.
+ *
+ *   0      2         3        4        8             12      16       24
+ *   | magic | version | opcode | job_id | payload_len | flags | size   |
+ */
+#define FRAME_HDR_SIZE 24
+#define PROTO_MAGIC 0x4d53 // "MS"
+#define PROTO_VERSION 1
+#define MAX_UPLOAD ((uint64_t)1 << 36) // Largest input file accepted, room for the largest matinv -f matrix
+
+enum Opcode
+{
+    OP_CMD = 1,    // client -> server: payload command, data input file (kmeans -f)
+    OP_RESULT = 2, // server -> client: payload solution filename, data result
+    OP_ERROR = 3   // server -> client: payload error message
+};
+
+struct frame_hdr
+{
+    uint8_t version;
+    uint8_t opcode;
+    uint32_t job_id;
+    uint32_t payload_len;
+    uint32_t flags; // Reserved, 0
+    uint64_t size;
+};
+
+/* Functions */
+
+void frame_pack(char buf[FRAME_HDR_SIZE], struct frame_hdr *hdr);
+int frame_unpack(const char buf[FRAME_HDR_SIZE], struct frame_hdr *hdr);
+int send_all(int sd, const void *buf, size_t len);
+int recv_all(int sd, void *buf, size_t len);
+int send_frame(int sd, int opcode, uint32_t job_id, const char *payload, uint32_t payload_len,
+               const char *data, uint64_t size);
+int recv_frame(int sd, struct frame_hdr *hdr, char payload[], size_t payload_max);
+int recv_to_fd(int sd, int fd, uint64_t size);
+
+#endif // PROTO_UTIL_H
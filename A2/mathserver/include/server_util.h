@@ -8,6 +8,12 @@
 /* Failing exit status for features not implemented */
 #define EXIT_NOT_IMPLEMENTED 3
 
+/* Max arguments in a kmeans/matinv command */
+#define MAX_ARGS 64
+
+/* Max events handled per epoll_wait() call in muxscale */
+#define MAX_EVENTS 256
+
 enum Strategy
 {
     FORK,
@@ -17,11 +23,13 @@ enum Strategy
 
 /* Functions */
 
-void run_with_fork(int port, char cwd[]);
-void run_with_muxbasic();
-void run_with_muxscale();
+void run_with_fork(int port, char cwd[], int binary);
+void run_with_muxbasic(int port, char cwd[], int binary);
+void run_with_muxscale(int port, char cwd[], int workers, int binary);
 void run_as_daemon(const char *process_name);
-void matinv_run(int sd, char command[], char cwd[], int client_num, int solution_num);
-void kmeans_run(int sd, char command[], char cwd[], int client_num, int solution_num);
+char *kmeans_exec(char command[], char cwd[], char *input, size_t input_len, size_t *result_len);
+char *matinv_exec(char command[], char *input, size_t input_len, size_t *result_len);
+void matinv_run(int sd, char command[]);
+void kmeans_run(int sd, char command[], char cwd[]);
 
 #endif // SERVER_UTIL_H
@@ -1,20 +1,35 @@
+#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <libgen.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include "../include/file_util.h"
+#include "../include/proto_util.h"
 
 // Flags and default values.
-int ip_f = 0, port = -1;
+int ip_f = 0, port = -1, text = 0;
 char *ip = "";
 
+// Binary protocol: requests in flight, answered on the receiver thread
+int outstanding = 0;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t answered = PTHREAD_COND_INITIALIZER;
+
 // Forward declarations
 void usage();
 void read_options(int argc, char *argv[]);
+void run_text(int sd, char command[]);
+void run_binary(int sd, char command[]);
+void *recv_results(void *arg);
 
 int main(int argc, char *argv[])
 {
@@ -43,16 +58,26 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    // Binary results arrive in any order while further commands are sent
+    pthread_t receiver;
+    if (!text && pthread_create(&receiver, NULL, recv_results, &sd) != 0)
+    {
+        perror("Cannot start receiver");
+        exit(EXIT_FAILURE);
+    }
+
     // Start communication with server
     while (1)
     {
         // Take user input
-        char command[BUF_SIZE], res_filename[BUF_SIZE];
+        char command[BUF_SIZE];
         memset(command, 0, BUF_SIZE);
-        memset(res_filename, 0, BUF_SIZE);
         printf("Enter a command for the server: ");
-        fgets(command, BUF_SIZE, stdin);
-        command[strlen(command) - 1] = '\0'; // Remove newline from command
+        if (fgets(command, BUF_SIZE, stdin) == NULL)
+        {
+            break; // End of input
+        }
+        command[strcspn(command, "\n")] = '\0'; // Remove newline from command
 
         // Check if the command from input is either a kmeans or matinv command.
         int intitial_chars = (strlen(command) > 6) ? 7 : 6;
@@ -63,32 +88,153 @@ int main(int argc, char *argv[])
             continue;
         }
 
-        // Send command to server
-        if ((send(sd, command, strlen(command), 0)) == -1)
+        if (text)
         {
-            perror("Error sending command");
-            exit(EXIT_FAILURE);
+            run_text(sd, command);
+        }
+        else
+        {
+            run_binary(sd, command);
+        }
+    }
+
+    // Wait for the results of all queued commands
+    pthread_mutex_lock(&lock);
+    while (outstanding > 0)
+    {
+        pthread_cond_wait(&answered, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    // The receiver is back in recv(), stop it before the socket goes away
+    if (!text)
+    {
+        pthread_cancel(receiver);
+        pthread_join(receiver, NULL);
+    }
+    close(sd);
+    return 0;
+}
+
+/*
+ * Old text protocol: command, solution filename, input file, result.
+ */
+void run_text(int sd, char command[])
+{
+    char res_filename[BUF_SIZE];
+    memset(res_filename, 0, BUF_SIZE);
+
+    // Send command to server, always a BUF_SIZE frame like the file size
+    if (send_all(sd, command, BUF_SIZE) == -1)
+    {
+        perror("Error sending command");
+        exit(EXIT_FAILURE);
+    }
+
+    // Recieve results filename from server.
+    if (recv(sd, res_filename, sizeof(res_filename) - 1, 0) <= 0)
+    {
+        perror("Error receiving filename");
+        exit(EXIT_FAILURE);
+    }
+    printf("Received the solution: %s\n", res_filename);
+    char filename[PATH_SIZE] = "../computed_results/";
+    strncat(filename, res_filename, PATH_SIZE - strlen(filename) - 1);
+
+    // Check if -f flag is set in the command, send input file if so
+    parse_command(sd, command);
+
+    // Receive results data
+    recv_file(sd, filename);
+}
+
+/*
+ * Binary protocol: send one frame with the command and input file. The
+ * server answers with a frame with the same job id, which recv_results()
+ * handles, so further commands can be queued right away.
+ */
+void run_binary(int sd, char command[])
+{
+    static uint32_t job_id = 0;
+    char input_path[PATH_SIZE];
+    struct stat st;
+    int fd = -1;
+
+    job_id++;
+    st.st_size = 0;
+    if (f_flag_path(command, input_path))
+    {
+        if ((fd = open(input_path, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+        {
+            perror("Error opening input file");
+            return;
         }
+    }
+
+    pthread_mutex_lock(&lock);
+    outstanding++;
+    pthread_mutex_unlock(&lock);
 
-        // Recieve results filename from server.
-        if (recv(sd, res_filename, sizeof(res_filename), 0) == -1)
+    if (send_frame(sd, OP_CMD, job_id, command, strlen(command), NULL, st.st_size) == -1 ||
+        (fd != -1 && send_file_data(sd, fd, st.st_size) == -1))
+    {
+        perror("Error sending command");
+        exit(EXIT_FAILURE);
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+/*
+ * Receiver thread: save each result frame as it arrives.
+ */
+void *recv_results(void *arg)
+{
+    int sd = *(int *)arg;
+    char res_filename[PATH_SIZE];
+    struct frame_hdr hdr;
+
+    while (1)
+    {
+        if (recv_frame(sd, &hdr, res_filename, sizeof(res_filename)) == -1)
         {
-            perror("Error receiving filename");
+            perror("Error receiving result");
             exit(EXIT_FAILURE);
         }
-        printf("Received the solution: %s\n", res_filename);
-        char filename[PATH_SIZE] = "../computed_results/";
-        strncat(filename, res_filename, PATH_SIZE - strlen(filename));
 
-        // Check if -f flag is set in kmeans command, send input file if so
-        if (strncmp(command, "kmeans", 6) == 0)
+        if (hdr.opcode == OP_ERROR)
+        {
+            printf("%s (job %u)\n", res_filename, hdr.job_id);
+        }
+        else
         {
-            parse_command(sd, command);
+            printf("Received the solution: %s (job %u)\n", res_filename, hdr.job_id);
+
+            // Never let the server pick a path outside computed_results
+            char filename[PATH_SIZE] = "../computed_results/";
+            strncat(filename, basename(res_filename), PATH_SIZE - strlen(filename) - 1);
+            int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd == -1)
+            {
+                perror("Error opening file");
+                exit(EXIT_FAILURE);
+            }
+            if (recv_to_fd(sd, fd, hdr.size) == -1)
+            {
+                perror("Error receiving result");
+                exit(EXIT_FAILURE);
+            }
+            close(fd);
         }
 
-        // Receive results data
-        recv_file(sd, filename);
+        pthread_mutex_lock(&lock);
+        outstanding--;
+        pthread_cond_signal(&answered);
+        pthread_mutex_unlock(&lock);
     }
+    return NULL;
 }
 
 void read_options(int argc, char *argv[])
@@ -114,6 +260,9 @@ void read_options(int argc, char *argv[])
             case 'p':
                 port = atoi(argv[++i]);
                 break;
+            case 't':
+                text = 1;
+                break;
             case 'h':
             case 'u':
                 usage();
@@ -138,5 +287,6 @@ void usage()
 {
     printf("\nUsage: client [-p port]\n");
     printf("              [-ip address]\n");
+    printf("              [-t]          use the old text protocol\n");
     printf("              [-h]          help\n");
 }
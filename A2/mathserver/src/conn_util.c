@@ -0,0 +1,632 @@
+/*
+ * Per-connection state machine for the multiplexing strategies.
+ * All socket I/O is non-blocking: every call does as much as the socket
+ * allows and remembers where it stopped.
+ *
+ * A binary connection keeps reading while its requests run (up to
+ * MAX_PIPELINE of them) and answers them in the order they finish; the job
+ * id in each frame tells the client which request a result belongs to.
+ * A text connection has a single request at a time.
+ */
+
+#define _GNU_SOURCE // splice
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../include/conn_util.h"
+#include "../include/proto_util.h"
+#include "../include/server_util.h"
+
+/*
+ * Executed on a worker: run the job the request described.
+ */
+static void conn_run_job(struct job *job)
+{
+    struct request *r = (struct request *)job->arg;
+
+    // Nobody is waiting for the results of a client that went away
+    if (__atomic_load_n(&r->conn->dead, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    if (strcmp(r->cmd, "kmeans") == 0)
+    {
+        r->result = kmeans_exec(r->command, r->conn->cwd, r->input, r->input_len, &r->result_len);
+    }
+    else
+    {
+        r->result = matinv_exec(r->command, r->input, r->input_len, &r->result_len);
+    }
+}
+
+static struct request *request_new(struct conn *c)
+{
+    struct request *r = calloc(1, sizeof(struct request));
+    if (r == NULL)
+    {
+        perror("Cannot allocate request");
+        return NULL;
+    }
+    r->conn = c;
+    r->result_fd = -1;
+    r->job.run = conn_run_job;
+    r->job.arg = r;
+    return r;
+}
+
+void request_free(struct request *r)
+{
+    if (r->result_fd >= 0)
+        close(r->result_fd);
+    free(r->input);
+    free(r->result);
+    free(r);
+}
+
+struct conn *conn_new(int fd, int client_num, char cwd[], int binary)
+{
+    struct conn *c = calloc(1, sizeof(struct conn));
+    if (c == NULL)
+    {
+        return NULL;
+    }
+    c->fd = fd;
+    c->client_num = client_num;
+    c->cwd = cwd;
+    c->binary = binary;
+    c->state = binary ? CONN_READ_HDR : CONN_READ_CMD;
+    return c;
+}
+
+/*
+ * Free the connection and the requests it holds. Requests out on a job
+ * are not its to free, so `c->jobs` must be 0.
+ */
+void conn_free(struct conn *c)
+{
+    if (c->fd >= 0)
+        close(c->fd);
+    if (c->req != NULL)
+        request_free(c->req);
+    while (c->head != NULL)
+    {
+        struct request *next = c->head->next;
+        request_free(c->head);
+        c->head = next;
+    }
+    free(c);
+}
+
+/*
+ * Append `len` bytes to the outgoing frames.
+ */
+static void conn_queue(struct conn *c, const char *data, size_t len)
+{
+    if (c->out_off > 0)
+    {
+        memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+        c->out_len -= c->out_off;
+        c->out_off = 0;
+    }
+    if (len > sizeof(c->out) - c->out_len)
+    {
+        len = sizeof(c->out) - c->out_len;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+/*
+ * Queue a binary frame header followed by its payload.
+ */
+static void conn_queue_frame(struct conn *c, int opcode, uint32_t job_id, const char *payload, uint64_t size)
+{
+    char hdr_buf[FRAME_HDR_SIZE];
+    struct frame_hdr hdr = {PROTO_VERSION, opcode, job_id, strlen(payload), 0, size};
+    frame_pack(hdr_buf, &hdr);
+    conn_queue(c, hdr_buf, FRAME_HDR_SIZE);
+    conn_queue(c, payload, hdr.payload_len);
+}
+
+/*
+ * Append a finished request to the send queue.
+ */
+static void conn_answer(struct conn *c, struct request *r)
+{
+    r->next = NULL;
+    if (c->tail != NULL)
+        c->tail->next = r;
+    else
+        c->head = r;
+    c->tail = r;
+}
+
+/*
+ * Check the command in `msg` and name its solution.
+ * Returns -1 if it is neither kmeans nor matinv.
+ */
+static int conn_command(struct conn *c, struct request *r, char msg[])
+{
+    snprintf(r->cmd, sizeof(r->cmd), "%.6s", msg);
+    printf("Client %d commanded: %s\n", c->client_num, msg);
+
+    if (strcmp(r->cmd, "matinv") != 0 && strcmp(r->cmd, "kmeans") != 0)
+    {
+        return -1;
+    }
+
+    c->solution_num++;
+    snprintf(r->solution, sizeof(r->solution), "%s_client%d_soln%d.txt", r->cmd, c->client_num, c->solution_num);
+    printf("Sending solution: %s\n", r->solution);
+    if (msg != r->command)
+    {
+        snprintf(r->command, PATH_SIZE, "%s", msg);
+    }
+    return 0;
+}
+
+/*
+ * Text protocol: a full command arrived in `msg`. Reply with the solution
+ * filename and decide whether an input file follows.
+ */
+static int conn_text_command(struct conn *c, char msg[])
+{
+    if (conn_command(c, c->req, msg) == -1)
+    {
+        // Send error message to client
+        char error[] = "Error! Valid commands: 'matinv' or 'kmeans'";
+        conn_queue(c, error, sizeof(error));
+        c->close_after_send = 1;
+        return CONN_OK;
+    }
+    conn_queue(c, c->req->solution, strlen(c->req->solution));
+
+    if (has_f_flag(msg))
+    {
+        c->frame_len = 0;
+        c->state = CONN_READ_SIZE;
+        return CONN_OK;
+    }
+    return CONN_JOB;
+}
+
+/*
+ * Allocate room for `size` bytes of input and start receiving them.
+ */
+static int conn_start_upload(struct conn *c, uint64_t size)
+{
+    c->remain = size;
+    c->req->input_len = 0;
+    c->req->input = malloc(size + 1);
+    if (c->req->input == NULL)
+    {
+        perror("Cannot allocate input");
+        return CONN_CLOSE;
+    }
+    c->state = CONN_READ_FILE;
+    return CONN_OK;
+}
+
+/*
+ * The request, including its input file, has been received completely.
+ */
+static int conn_request_done(struct conn *c)
+{
+    if (!c->binary)
+    {
+        return CONN_JOB;
+    }
+
+    c->state = CONN_READ_HDR;
+    c->frame_len = 0;
+    if (conn_command(c, c->req, c->req->command) == -1)
+    {
+        // The frame was consumed entirely, so the connection can go on
+        c->req->error = "Error! Valid commands: 'matinv' or 'kmeans'";
+        c->pending++;
+        conn_answer(c, c->req);
+        c->req = NULL;
+        return CONN_OK;
+    }
+    return CONN_JOB;
+}
+
+int conn_wants_read(struct conn *c)
+{
+    if (c->eof || c->close_after_send || c->state == CONN_BUSY)
+    {
+        return 0;
+    }
+    // Leave further requests in the socket until some of the running ones are answered
+    return c->state != CONN_READ_HDR || c->pending < MAX_PIPELINE;
+}
+
+/*
+ * Read as much as is available. Returns CONN_JOB once a complete request
+ * (command plus optional input file) has been received, with the request
+ * in `*job`; call again for more.
+ */
+int conn_read(struct conn *c, struct request **job)
+{
+    char buf[BUF_SIZE];
+    ssize_t n;
+
+    while (1)
+    {
+        if (c->eof && c->pending == 0 && c->out_len == c->out_off)
+        {
+            return CONN_CLOSE; // Everything answered
+        }
+        if (!conn_wants_read(c))
+        {
+            return CONN_OK;
+        }
+        if (c->req == NULL && (c->req = request_new(c)) == NULL)
+        {
+            return CONN_CLOSE;
+        }
+
+        switch (c->state)
+        {
+        case CONN_READ_CMD:
+        case CONN_READ_SIZE:
+            n = recv(c->fd, c->frame + c->frame_len, BUF_SIZE - c->frame_len, 0);
+            break;
+        case CONN_READ_HDR:
+            n = recv(c->fd, c->frame + c->frame_len, FRAME_HDR_SIZE - c->frame_len, 0);
+            break;
+        case CONN_READ_PAYLOAD:
+            n = recv(c->fd, c->req->command + c->frame_len, c->payload_len - c->frame_len, 0);
+            break;
+        case CONN_READ_FILE:
+            n = recv(c->fd, c->req->input + c->req->input_len, c->remain, 0);
+            break;
+        case CONN_SKIP_FILE:
+            n = recv(c->fd, buf, c->remain < BUF_SIZE ? c->remain : BUF_SIZE, 0);
+            break;
+        default:
+            return CONN_OK;
+        }
+
+        if (n == 0)
+        {
+            // Client done sending. Answer what it asked for, unless it quit mid-request.
+            if ((c->state != CONN_READ_CMD && c->state != CONN_READ_HDR) || c->frame_len > 0)
+            {
+                return CONN_CLOSE;
+            }
+            c->eof = 1;
+            continue;
+        }
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_OK;
+            if (errno == EINTR)
+                continue;
+            return CONN_CLOSE;
+        }
+
+        int rc = CONN_OK;
+        switch (c->state)
+        {
+        case CONN_READ_CMD:
+            c->frame_len += n;
+            if (c->frame_len < BUF_SIZE)
+                break;
+            c->frame[BUF_SIZE - 1] = '\0';
+            c->frame_len = 0;
+            rc = conn_text_command(c, c->frame);
+            break;
+
+        case CONN_READ_SIZE:
+            c->frame_len += n;
+            if (c->frame_len < BUF_SIZE)
+                break;
+            c->frame[BUF_SIZE - 1] = '\0';
+            if (atoll(c->frame) < 0)
+                return CONN_CLOSE;
+            if ((uint64_t)atoll(c->frame) > MAX_UPLOAD)
+            {
+                char error[] = "Error! Input file too large";
+                conn_queue(c, error, sizeof(error));
+                c->close_after_send = 1;
+                return CONN_OK;
+            }
+            if (conn_start_upload(c, atoll(c->frame)) == CONN_CLOSE)
+                return CONN_CLOSE;
+            if (c->remain == 0)
+                rc = conn_request_done(c);
+            break;
+
+        case CONN_READ_HDR:
+        {
+            struct frame_hdr hdr;
+            c->frame_len += n;
+            if (c->frame_len < FRAME_HDR_SIZE)
+                break;
+            if (frame_unpack(c->frame, &hdr) == -1 || hdr.opcode != OP_CMD ||
+                hdr.payload_len == 0 || hdr.payload_len >= PATH_SIZE)
+            {
+                // Framing is lost, nothing sensible can follow. Answer what runs, then close.
+                c->req->error = "Error! Invalid frame";
+                c->pending++;
+                conn_answer(c, c->req);
+                c->req = NULL;
+                c->eof = 1;
+                continue;
+            }
+            if (hdr.size > MAX_UPLOAD)
+            {
+                c->req->error = "Error! Input file too large";
+            }
+            c->req->job_id = hdr.job_id;
+            c->payload_len = hdr.payload_len;
+            c->remain = hdr.size;
+            c->frame_len = 0;
+            c->state = CONN_READ_PAYLOAD;
+            break;
+        }
+
+        case CONN_READ_PAYLOAD:
+            c->frame_len += n;
+            if (c->frame_len < c->payload_len)
+                break;
+            c->req->command[c->payload_len] = '\0';
+            if (c->req->error != NULL)
+            {
+                // Answer now, then read past the input to the next frame
+                c->pending++;
+                conn_answer(c, c->req);
+                c->req = NULL;
+                c->frame_len = 0;
+                c->state = CONN_SKIP_FILE;
+                break;
+            }
+            if (conn_start_upload(c, c->remain) == CONN_CLOSE)
+                return CONN_CLOSE;
+            if (c->remain == 0)
+                rc = conn_request_done(c);
+            break;
+
+        case CONN_READ_FILE:
+            c->req->input_len += n;
+            c->remain -= n;
+            if (c->remain == 0)
+                rc = conn_request_done(c);
+            break;
+
+        case CONN_SKIP_FILE:
+            c->remain -= n;
+            if (c->remain == 0)
+                c->state = CONN_READ_HDR;
+            break;
+
+        default:
+            break;
+        }
+
+        if (rc == CONN_JOB)
+        {
+            if (!c->binary)
+            {
+                c->state = CONN_BUSY;
+            }
+            c->pending++;
+            c->jobs++;
+            *job = c->req;
+            c->req = NULL;
+            return CONN_JOB;
+        }
+    }
+}
+
+/*
+ * A muxbasic child writes the size of its result to its pipe before the
+ * result itself. Read it, so that the result can be spliced to the socket.
+ * Returns 1 once the size is known, 0 if it has not arrived yet and -1 if
+ * the child exited without a result.
+ */
+int conn_read_result_size(struct request *r)
+{
+    uint64_t size;
+    while (1)
+    {
+        // Written with a single write() of less than PIPE_BUF bytes, so it arrives whole
+        ssize_t n = read(r->result_fd, &size, sizeof(size));
+        if (n == sizeof(size))
+        {
+            r->result_len = size;
+            return 1;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n < 0 && errno == EINTR)
+            continue;
+        return -1;
+    }
+}
+
+/*
+ * The job of `r` finished: its result is in `r->result`, or announced on
+ * `r->result_fd`. Queue it to be sent, or drop it if the client is gone.
+ */
+void conn_job_done(struct request *r)
+{
+    struct conn *c = r->conn;
+
+    c->jobs--;
+    free(r->input);
+    r->input = NULL;
+    if (c->dead)
+    {
+        request_free(r);
+        return;
+    }
+    if (r->result == NULL && r->result_fd < 0)
+    {
+        r->result_len = 0;
+    }
+    conn_answer(c, r);
+}
+
+int conn_wants_write(struct conn *c)
+{
+    if (c->out_off < c->out_len)
+    {
+        return 1;
+    }
+    return c->head != NULL && !c->head->pipe_empty;
+}
+
+/*
+ * Send the queued frames. Returns CONN_READY once all are sent.
+ */
+static int conn_flush(struct conn *c)
+{
+    while (c->out_off < c->out_len)
+    {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_OK;
+            if (errno == EINTR)
+                continue;
+            return CONN_CLOSE;
+        }
+        c->out_off += n;
+    }
+    c->out_off = c->out_len = 0;
+    return CONN_READY;
+}
+
+/*
+ * Send the result of `r` from where the last call stopped. Returns
+ * CONN_READY once all of it is sent.
+ */
+static int conn_send_result(struct conn *c, struct request *r)
+{
+    ssize_t n;
+
+    while (c->result_off < r->result_len && r->result_fd >= 0)
+    {
+        // Move the pipe's pages to the socket without copying them through user space
+        n = splice(r->result_fd, NULL, c->fd, NULL, r->result_len - c->result_off,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0)
+        {
+            return CONN_CLOSE; // The child died before writing all it announced
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                return CONN_CLOSE;
+
+            // Either the socket is full or the pipe is empty; in the latter case wait for the child
+            int avail = 0;
+            if (ioctl(r->result_fd, FIONREAD, &avail) == 0 && avail == 0)
+            {
+                r->pipe_empty = 1;
+            }
+            return CONN_OK;
+        }
+        c->result_off += n;
+    }
+
+    while (c->result_off < r->result_len)
+    {
+        n = send(c->fd, r->result + c->result_off, r->result_len - c->result_off, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_OK;
+            if (errno == EINTR)
+                continue;
+            return CONN_CLOSE;
+        }
+        c->result_off += n;
+    }
+    return CONN_READY;
+}
+
+/*
+ * Flush pending frames and send the finished results in order. Returns
+ * CONN_READY when at least one result has been sent completely.
+ */
+int conn_write(struct conn *c)
+{
+    int rc = conn_flush(c), sent = 0;
+    if (rc != CONN_READY)
+    {
+        return rc;
+    }
+    if (c->close_after_send)
+    {
+        return CONN_CLOSE;
+    }
+
+    while (c->head != NULL)
+    {
+        struct request *r = c->head;
+        if (r->pipe_empty)
+        {
+            break; // The event loop calls again once the child wrote more
+        }
+
+        if (!c->sending)
+        {
+            // The frame header (or text size frame) goes out right before the data
+            if (r->error != NULL)
+            {
+                conn_queue_frame(c, OP_ERROR, r->job_id, r->error, 0);
+            }
+            else if (c->binary)
+            {
+                conn_queue_frame(c, OP_RESULT, r->job_id, r->solution, r->result_len);
+            }
+            else
+            {
+                char file_size[BUF_SIZE] = {0};
+                snprintf(file_size, BUF_SIZE, "%zu", r->result_len);
+                conn_queue(c, file_size, sizeof(file_size));
+            }
+            clock_gettime(CLOCK_MONOTONIC, &r->sent_at);
+            c->sending = 1;
+            c->result_off = 0;
+            if ((rc = conn_flush(c)) != CONN_READY)
+                return rc;
+        }
+
+        if (r->error == NULL)
+        {
+            if ((rc = conn_send_result(c, r)) != CONN_READY)
+                return rc;
+            log_transfer(r->solution, r->result_len, &r->sent_at);
+        }
+
+        c->head = r->next;
+        if (c->head == NULL)
+            c->tail = NULL;
+        c->sending = 0;
+        c->pending--;
+        request_free(r);
+        sent = 1;
+
+        if (!c->binary)
+        {
+            c->frame_len = 0;
+            c->state = CONN_READ_CMD;
+        }
+    }
+    return sent ? CONN_READY : CONN_OK;
+}
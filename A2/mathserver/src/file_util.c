@@ -1,46 +1,140 @@
+#define _GNU_SOURCE // vmsplice
+
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include "../include/file_util.h"
+#include "../include/proto_util.h"
 
 /*
  * Receive file from socket `sd`. Save it as `filename`.
  */
 void recv_file(int sd, char filename[])
 {
-    int file_size = 0;
     char recvbuf[BUF_SIZE] = {0};
-    int recv_bytes; // How many bytes are recieved by call to recv().
 
-    if ((recv_bytes = recv(sd, recvbuf, sizeof(recvbuf), 0)) == -1)
+    // The size frame is always BUF_SIZE bytes, however TCP splits or merges it
+    if (recv_all(sd, recvbuf, BUF_SIZE) == -1)
     {
         perror("Error recieving file");
         exit(EXIT_FAILURE);
     }
+    recvbuf[BUF_SIZE - 1] = '\0';
 
-    FILE *fp = fopen(filename, "w");
-    if (fp == NULL)
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1)
     {
         perror("Error opening file");
         exit(EXIT_FAILURE);
     }
 
-    file_size = atoi(recvbuf);
-    int remain = file_size;
-    memset(recvbuf, 0, BUF_SIZE);
-
-    while ((remain > 0) && ((recv_bytes = recv(sd, recvbuf, sizeof(recvbuf), 0)) > 0))
+    if (recv_to_fd(sd, fd, strtoull(recvbuf, NULL, 10)) == -1)
     {
-        // Writes recv_bytes number of bytes from recvbuf to file.
-        fwrite(recvbuf, sizeof(char), recv_bytes, fp);
-        remain -= recv_bytes;
+        perror("Error recieving file");
+        exit(EXIT_FAILURE);
     }
-    fclose(fp);
+    close(fd);
 };
 
+/*
+ * Send `size` bytes of open file `fd` to socket `sd`. The kernel copies the
+ * page cache straight to the socket with sendfile(); files it cannot do that
+ * for are sent in large chunks.
+ */
+int send_file_data(int sd, int fd, off_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = sendfile(sd, fd, NULL, size);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL || errno == ENOSYS)
+                break; // Not a regular file, fall back to read()
+            return -1;
+        }
+        if (n == 0)
+        {
+            return -1; // File shorter than `size`
+        }
+        size -= n;
+    }
+
+    char buf[CHUNK_SIZE];
+    while (size > 0)
+    {
+        ssize_t n = read(fd, buf, size < (off_t)sizeof(buf) ? size : (off_t)sizeof(buf));
+        if (n <= 0)
+        {
+            return -1;
+        }
+        if (send_all(sd, buf, n) == -1)
+        {
+            return -1;
+        }
+        size -= n;
+    }
+    return 0;
+}
+
+/*
+ * Write `len` bytes of `data` to pipe `fd`. vmsplice() maps the pages into the
+ * pipe instead of copying them, so `data` must stay untouched until the
+ * reader has drained the pipe (the caller exits right after). Falls back to
+ * write() where vmsplice() is not available.
+ */
+int pipe_data(int fd, const char *data, size_t len)
+{
+    int use_vmsplice = 1;
+    while (len > 0)
+    {
+        ssize_t n;
+        if (use_vmsplice)
+        {
+            struct iovec iov = {(void *)data, len};
+            n = vmsplice(fd, &iov, 1, 0);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+            {
+                use_vmsplice = 0;
+                continue;
+            }
+        }
+        else
+        {
+            n = write(fd, data, len);
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Log the throughput of sending `bytes` bytes of `name`, started at `start`.
+ */
+void log_transfer(const char name[], size_t bytes, const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+    printf("Sent %s: %zu bytes in %.3f ms (%.1f MB/s)\n", name, bytes, secs * 1e3,
+           secs > 0 ? bytes / secs / 1e6 : 0.0);
+}
 
 /*
  * Send file `filename` to socket `sd`.
@@ -48,42 +142,89 @@ void recv_file(int sd, char filename[])
 void send_file(int sd, char filename[])
 {
     // Open file
-    FILE *fp = fopen(filename, "r");
-    if (fp == NULL)
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
     {
         perror("send_file: Error opening file");
         exit(EXIT_FAILURE);
     }
 
     // Send file size to recieve to socket.
-    char file_size[BUF_SIZE];
+    char file_size[BUF_SIZE] = {0};
     struct stat file_stat;
-    if (fstat(fileno(fp), &file_stat) < 0)
+    if (fstat(fd, &file_stat) < 0)
     {
         perror("Error reading file size");
         exit(EXIT_FAILURE);
     }
 
-    snprintf(file_size, BUF_SIZE, "%d", file_stat.st_size);
-    if ((send(sd, file_size, sizeof(file_size), 0)) == -1)
+    snprintf(file_size, BUF_SIZE, "%lld", (long long)file_stat.st_size);
+    if (send_all(sd, file_size, sizeof(file_size)) == -1)
     {
         perror("Error sending file size");
         exit(EXIT_FAILURE);
     }
 
     // Send file data.
-    char output[BUF_SIZE] = "";
-    memset(output, 0, BUF_SIZE);
-    while (fgets(output, sizeof(output), fp) != NULL)
+    if (send_file_data(sd, fd, file_stat.st_size) == -1)
     {
-        if ((send(sd, output, strlen(output), 0)) == -1)
-        {
-            perror("Error sending file");
-            exit(EXIT_FAILURE);
-        }
-        memset(output, 0, BUF_SIZE);
+        perror("Error sending file");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+/*
+ * Receive data sent with send_data() or send_file() from socket `sd`.
+ * Returns a malloc'd buffer and its size in `len`.
+ */
+char *recv_data(int sd, size_t *len)
+{
+    char recvbuf[BUF_SIZE] = {0};
+
+    // The size frame is always BUF_SIZE bytes
+    if (recv_all(sd, recvbuf, BUF_SIZE) == -1)
+    {
+        perror("Error recieving file");
+        exit(EXIT_FAILURE);
+    }
+    recvbuf[BUF_SIZE - 1] = '\0';
+
+    size_t size = strtoull(recvbuf, NULL, 10);
+    char *data = malloc(size + 1);
+    if (data == NULL)
+    {
+        perror("Error allocating file");
+        exit(EXIT_FAILURE);
+    }
+    if (recv_all(sd, data, size) == -1)
+    {
+        perror("Error recieving file");
+        exit(EXIT_FAILURE);
+    }
+    data[size] = '\0';
+    *len = size;
+    return data;
+}
+
+/*
+ * Send `len` bytes of `data` to socket `sd`, preceded by its size, the same
+ * way send_file() sends a file.
+ */
+void send_data(int sd, char data[], size_t len)
+{
+    char file_size[BUF_SIZE] = {0};
+    snprintf(file_size, BUF_SIZE, "%zu", len);
+    if (send_all(sd, file_size, sizeof(file_size)) == -1)
+    {
+        perror("Error sending file size");
+        exit(EXIT_FAILURE);
+    }
+    if (send_all(sd, data, len) == -1)
+    {
+        perror("Error sending file");
+        exit(EXIT_FAILURE);
     }
-    fclose(fp);
 }
 
 /*
@@ -117,14 +258,36 @@ void parse_command(int sd, char command[])
  */
 int has_f_flag(char command[])
 {
-    char *ptr = strtok(command, " ");
+    char path[PATH_SIZE];
+    return f_flag_path(command, path);
+}
+
+/*
+ * Parse command for the "-f" flag. If it is set with a filename, copy the
+ * filename to `path` and return 1.
+ */
+int f_flag_path(char command[], char path[])
+{
+    // Tokenize a copy, strtok() would cut `command` at the first space
+    char copy[PATH_SIZE];
+    char *save;
+    snprintf(copy, sizeof(copy), "%s", command);
+
+    char *ptr = strtok_r(copy, " ", &save);
     while (ptr != NULL)
     {
         if (strcmp(ptr, "-f") == 0)
         {
+            // The filename is the next argument
+            ptr = strtok_r(NULL, " ", &save);
+            if (ptr == NULL)
+            {
+                return 0;
+            }
+            snprintf(path, PATH_SIZE, "%s", ptr);
             return 1;
         }
-        ptr = strtok(NULL, " ");
+        ptr = strtok_r(NULL, " ", &save);
     }
     return 0;
 }
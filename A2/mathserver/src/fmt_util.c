@@ -0,0 +1,454 @@
+/*
+ * Shortest round-trip formatting of doubles (see fmt_util.h).
+ *
+ * This is Ulf Adams' Ryu algorithm (PLDI 2018): the decimal interval of
+ * values that read back as the same double is computed with 128-bit
+ * fixed-point multiplications by 5^i or 2^j / 5^i, and digits are
+ * dropped while the interval still holds a number with fewer of them.
+ * No printf, no bignums per number, and the output is the shortest
+ * string that strtod() turns back into exactly the same double.
+ *
+ * The two tables of 125-bit powers of 5 are computed once, on first use,
+ * with a small bignum instead of being compiled in.
+ *
+ * Also fixed two-decimal floats and ints, for the kmeans results.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../include/fmt_util.h"
+
+#define MANTISSA_BITS 52
+#define EXPONENT_BITS 11
+#define BIAS 1023
+#define POW5_INV_BITCOUNT 125
+#define POW5_BITCOUNT 125
+#define POW5_INV_TABLE_SIZE 342
+#define POW5_TABLE_SIZE 326
+
+static uint64_t pow5_inv_split[POW5_INV_TABLE_SIZE][2]; // floor(2^(bits(5^i) - 1 + 125) / 5^i) + 1
+static uint64_t pow5_split[POW5_TABLE_SIZE][2];         // 5^i scaled to 125 bits
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+/* Tables */
+
+#define BIG_WORDS 32 // 5^341 * 2 has < 800 bits
+
+struct big
+{
+    uint32_t w[BIG_WORDS]; // Little-endian words
+};
+
+static int big_bits(const struct big *a)
+{
+    for (int i = BIG_WORDS - 1; i >= 0; i--)
+    {
+        if (a->w[i])
+            return 32 * i + 32 - __builtin_clz(a->w[i]);
+    }
+    return 0;
+}
+
+// 128 bits of `a` starting at bit `shift`
+static unsigned __int128 big_bits128(const struct big *a, int shift)
+{
+    unsigned __int128 v = 0;
+    for (int bit = 127; bit >= 0; bit--)
+    {
+        int b = shift + bit;
+        v <<= 1;
+        if (b >= 0 && b < 32 * BIG_WORDS)
+            v |= (a->w[b / 32] >> (b % 32)) & 1;
+    }
+    return v;
+}
+
+static int big_cmp(const struct big *a, const struct big *b)
+{
+    for (int i = BIG_WORDS - 1; i >= 0; i--)
+    {
+        if (a->w[i] != b->w[i])
+            return a->w[i] < b->w[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+static void big_sub(struct big *a, const struct big *b)
+{
+    uint64_t borrow = 0;
+    for (int i = 0; i < BIG_WORDS; i++)
+    {
+        uint64_t d = (uint64_t)a->w[i] - b->w[i] - borrow;
+        a->w[i] = (uint32_t)d;
+        borrow = (d >> 63) & 1;
+    }
+}
+
+// a = 2a + bit
+static void big_shl1(struct big *a, int bit)
+{
+    for (int i = BIG_WORDS - 1; i > 0; i--)
+        a->w[i] = (a->w[i] << 1) | (a->w[i - 1] >> 31);
+    a->w[0] = (a->w[0] << 1) | bit;
+}
+
+static void split(uint64_t out[2], unsigned __int128 v)
+{
+    out[0] = (uint64_t)v;
+    out[1] = (uint64_t)(v >> 64);
+}
+
+static void build_tables(void)
+{
+    struct big pow5, rem;
+    memset(&pow5, 0, sizeof(pow5));
+    pow5.w[0] = 1;
+
+    for (int i = 0; i < POW5_INV_TABLE_SIZE; i++)
+    {
+        int len = big_bits(&pow5);
+        if (i < POW5_TABLE_SIZE)
+        {
+            int j = len - POW5_BITCOUNT;
+            split(pow5_split[i], j >= 0 ? big_bits128(&pow5, j) : big_bits128(&pow5, 0) << -j);
+        }
+
+        // Long division of 2^j by 5^i, one quotient bit at a time
+        int j = len - 1 + POW5_INV_BITCOUNT;
+        unsigned __int128 q = 0;
+        memset(&rem, 0, sizeof(rem));
+        for (int b = j; b >= 0; b--)
+        {
+            big_shl1(&rem, b == j);
+            q <<= 1;
+            if (big_cmp(&rem, &pow5) >= 0)
+            {
+                big_sub(&rem, &pow5);
+                q |= 1;
+            }
+        }
+        split(pow5_inv_split[i], q + 1);
+
+        // pow5 *= 5
+        uint64_t carry = 0;
+        for (int w = 0; w < BIG_WORDS; w++)
+        {
+            uint64_t p = (uint64_t)pow5.w[w] * 5 + carry;
+            pow5.w[w] = (uint32_t)p;
+            carry = p >> 32;
+        }
+    }
+}
+
+/* Ryu */
+
+// ceil(log2(5^e)), 1 for e == 0
+static inline int32_t pow5bits(int32_t e)
+{
+    return (int32_t)(((uint32_t)e * 1217359) >> 19) + 1;
+}
+
+// floor(log10(2^e))
+static inline uint32_t log10_pow2(int32_t e)
+{
+    return ((uint32_t)e * 78913) >> 18;
+}
+
+// floor(log10(5^e))
+static inline uint32_t log10_pow5(int32_t e)
+{
+    return ((uint32_t)e * 732923) >> 20;
+}
+
+static inline int multiple_of_pow5(uint64_t v, uint32_t p)
+{
+    uint32_t count = 0;
+    while (v % 5 == 0 && count < p)
+    {
+        v /= 5;
+        count++;
+    }
+    return count >= p;
+}
+
+static inline int multiple_of_pow2(uint64_t v, uint32_t p)
+{
+    return (v & ((1ull << p) - 1)) == 0;
+}
+
+static inline uint64_t mul_shift(uint64_t m, const uint64_t mul[2], int32_t j)
+{
+    unsigned __int128 b0 = (unsigned __int128)m * mul[0];
+    unsigned __int128 b2 = (unsigned __int128)m * mul[1];
+    return (uint64_t)(((b0 >> 64) + b2) >> (j - 64));
+}
+
+/*
+ * The shortest decimal `*digits` * 10^`*exp10` that reads back as the
+ * finite, non-zero double with these IEEE fields.
+ */
+static void shortest(uint64_t ieee_mantissa, uint32_t ieee_exponent, uint64_t *digits, int32_t *exp10)
+{
+    int32_t e2;
+    uint64_t m2;
+    if (ieee_exponent == 0)
+    {
+        e2 = 1 - BIAS - MANTISSA_BITS - 2; // 2 more bits for the bounds
+        m2 = ieee_mantissa;
+    }
+    else
+    {
+        e2 = (int32_t)ieee_exponent - BIAS - MANTISSA_BITS - 2;
+        m2 = (1ull << MANTISSA_BITS) | ieee_mantissa;
+    }
+    int accept_bounds = (m2 & 1) == 0; // Round half to even when reading back
+
+    // Interval of valid representations: mm < mv < mp, times 2^e2
+    uint64_t mv = 4 * m2;
+    uint32_t mm_shift = ieee_mantissa != 0 || ieee_exponent <= 1;
+
+    // To decimal: vm < vr < vp, times 10^e10
+    uint64_t vr, vp, vm;
+    int32_t e10;
+    int vm_trailing_zeros = 0, vr_trailing_zeros = 0;
+    if (e2 >= 0)
+    {
+        uint32_t q = log10_pow2(e2) - (e2 > 3);
+        int32_t k = POW5_INV_BITCOUNT + pow5bits(q) - 1;
+        int32_t i = -e2 + (int32_t)q + k;
+        e10 = (int32_t)q;
+        vr = mul_shift(4 * m2, pow5_inv_split[q], i);
+        vp = mul_shift(4 * m2 + 2, pow5_inv_split[q], i);
+        vm = mul_shift(4 * m2 - 1 - mm_shift, pow5_inv_split[q], i);
+        if (q <= 21)
+        {
+            // At most one of mp, mv and mm is a multiple of 5
+            if (mv % 5 == 0)
+                vr_trailing_zeros = multiple_of_pow5(mv, q);
+            else if (accept_bounds)
+                vm_trailing_zeros = multiple_of_pow5(mv - 1 - mm_shift, q);
+            else
+                vp -= multiple_of_pow5(mv + 2, q);
+        }
+    }
+    else
+    {
+        uint32_t q = log10_pow5(-e2) - (-e2 > 1);
+        int32_t i = -e2 - (int32_t)q;
+        int32_t k = pow5bits(i) - POW5_BITCOUNT;
+        int32_t j = (int32_t)q - k;
+        e10 = (int32_t)q + e2;
+        vr = mul_shift(4 * m2, pow5_split[i], j);
+        vp = mul_shift(4 * m2 + 2, pow5_split[i], j);
+        vm = mul_shift(4 * m2 - 1 - mm_shift, pow5_split[i], j);
+        if (q <= 1)
+        {
+            // mv = 4 * m2 has at least two trailing zero bits
+            vr_trailing_zeros = 1;
+            if (accept_bounds)
+                vm_trailing_zeros = mm_shift == 1;
+            else
+                --vp;
+        }
+        else if (q < 63)
+        {
+            vr_trailing_zeros = multiple_of_pow2(mv, q);
+        }
+    }
+
+    // Drop digits while the interval still holds a shorter number
+    int32_t removed = 0;
+    uint64_t output;
+    if (vm_trailing_zeros || vr_trailing_zeros)
+    {
+        // Rare: exact ties need the digits dropped so far
+        uint8_t last = 0;
+        while (vp / 10 > vm / 10)
+        {
+            vm_trailing_zeros &= vm % 10 == 0;
+            vr_trailing_zeros &= last == 0;
+            last = vr % 10;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        if (vm_trailing_zeros)
+        {
+            while (vm % 10 == 0)
+            {
+                vr_trailing_zeros &= last == 0;
+                last = vr % 10;
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed++;
+            }
+        }
+        if (vr_trailing_zeros && last == 5 && vr % 2 == 0)
+            last = 4; // Exactly .5: round to even
+        output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) || last >= 5);
+    }
+    else
+    {
+        int round_up = 0;
+        if (vp / 100 > vm / 100) // Two digits at a time first
+        {
+            round_up = vr % 100 >= 50;
+            vr /= 100;
+            vp /= 100;
+            vm /= 100;
+            removed += 2;
+        }
+        while (vp / 10 > vm / 10)
+        {
+            round_up = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        output = vr + (vr == vm || round_up);
+    }
+    *digits = output;
+    *exp10 = e10 + removed;
+}
+
+/*
+ * Write `v` to `buf` as the shortest decimal that reads back as `v`,
+ * like printf's %g: plain below 1e16 and from 1e-4 up, otherwise with an
+ * exponent ("1.5e-07"). Writes at most FMT_DOUBLE_MAX bytes plus a NUL,
+ * returns the length.
+ */
+int fmt_double(char *buf, double v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    uint64_t ieee_mantissa = bits & ((1ull << MANTISSA_BITS) - 1);
+    uint32_t ieee_exponent = (uint32_t)((bits >> MANTISSA_BITS) & ((1u << EXPONENT_BITS) - 1));
+    char *p = buf;
+
+    if (bits >> 63)
+        *p++ = '-';
+    if (ieee_exponent == (1u << EXPONENT_BITS) - 1)
+    {
+        p = stpcpy(p, ieee_mantissa ? "nan" : "inf");
+        return p - buf;
+    }
+    if (ieee_exponent == 0 && ieee_mantissa == 0)
+    {
+        p = stpcpy(p, "0");
+        return p - buf;
+    }
+
+    pthread_once(&tables_once, build_tables);
+    uint64_t output;
+    int32_t exp10;
+    shortest(ieee_mantissa, ieee_exponent, &output, &exp10);
+
+    char digits[20];
+    int n = 0;
+    for (uint64_t d = output; d > 0; d /= 10)
+        digits[19 - n++] = '0' + d % 10;
+    const char *d = digits + 20 - n;
+    int e = exp10 + n - 1; // Exponent in scientific notation
+
+    if (e >= -4 && e < 16)
+    {
+        if (e < 0) // 0.000ddd
+        {
+            *p++ = '0';
+            *p++ = '.';
+            for (int i = -1; i > e; i--)
+                *p++ = '0';
+            memcpy(p, d, n);
+            p += n;
+        }
+        else if (e + 1 >= n) // ddd000
+        {
+            memcpy(p, d, n);
+            p += n;
+            for (int i = n; i <= e; i++)
+                *p++ = '0';
+        }
+        else // dd.ddd
+        {
+            memcpy(p, d, e + 1);
+            p += e + 1;
+            *p++ = '.';
+            memcpy(p, d + e + 1, n - e - 1);
+            p += n - e - 1;
+        }
+    }
+    else
+    {
+        *p++ = d[0];
+        if (n > 1)
+        {
+            *p++ = '.';
+            memcpy(p, d + 1, n - 1);
+            p += n - 1;
+        }
+        *p++ = 'e';
+        *p++ = e < 0 ? '-' : '+';
+        int ae = e < 0 ? -e : e;
+        if (ae >= 100)
+            *p++ = '0' + ae / 100;
+        *p++ = '0' + ae / 10 % 10;
+        *p++ = '0' + ae % 10;
+    }
+    *p = '\0';
+    return p - buf;
+}
+
+/*
+ * Write `v` to `buf` exactly as printf("%.2f", v) does. 100 * v is exact
+ * in double for any float, so rounding it to an integer, to even as
+ * printf does on a tie, gives the same digits. Numbers too large for
+ * that, inf and nan go to snprintf. Writes at most FMT_FIXED2_MAX bytes
+ * plus a NUL, returns the length.
+ */
+int fmt_fixed2(char *buf, float v)
+{
+    double x = fabs((double)v * 100.0);
+    if (!(x < 1e18))
+        return snprintf(buf, FMT_FIXED2_MAX + 1, "%.2f", v);
+
+    uint64_t n = (uint64_t)nearbyint(x);
+    char digits[20], *p = buf;
+    int len = 0;
+    if (signbit(v))
+        *p++ = '-';
+    for (uint64_t d = n / 100; len == 0 || d > 0; d /= 10)
+        digits[19 - len++] = '0' + d % 10;
+    memcpy(p, digits + 20 - len, len);
+    p += len;
+    *p++ = '.';
+    *p++ = '0' + n / 10 % 10;
+    *p++ = '0' + n % 10;
+    *p = '\0';
+    return p - buf;
+}
+
+// Write `v` to `buf` as printf("%d", v) does, returns the length
+int fmt_int(char *buf, int v)
+{
+    char digits[10], *p = buf;
+    unsigned int u = v;
+    int len = 0;
+    if (v < 0)
+    {
+        *p++ = '-';
+        u = -u;
+    }
+    do
+        digits[9 - len++] = '0' + u % 10;
+    while (u /= 10);
+    memcpy(p, digits + 10 - len, len);
+    p += len;
+    *p = '\0';
+    return p - buf;
+}
@@ -0,0 +1,52 @@
+/***************************************************************************
+ *
+ * Convert kmeans text data into a binary dataset file (format in
+ * kmeans_kern.h), which kmeans, kmeans-seq and the server read without
+ * parsing any numbers.
+ *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/kmeans_kern.h"
+
+int main(int argc, char *argv[])
+{
+    struct kmeans km;
+    int checksum = 0;
+
+    if (argc > 1 && strcmp(argv[1], "-c") == 0)
+    {
+        checksum = 1;
+        argc--;
+        argv++;
+    }
+    if (argc != 3)
+    {
+        printf("Usage: kmeans-convert [-c] input.txt output.kmds\n");
+        printf("                [-c]             store a checksum of the points\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (kmeans_load_file(&km, argv[1], 1) == -1)
+    {
+        perror("Cannot open file");
+        exit(EXIT_FAILURE);
+    }
+    FILE *fp;
+    if ((fp = fopen(argv[2], "wb")) == NULL)
+    {
+        perror("Cannot write to file");
+        exit(EXIT_FAILURE);
+    }
+    if (kmeans_save(&km, fp, checksum) == -1 || fclose(fp) != 0)
+    {
+        perror("Cannot write to file");
+        exit(EXIT_FAILURE);
+    }
+    printf("%s: %d points of %d dimensions\n", argv[2], km.N, km.D);
+
+    kmeans_free(&km);
+    return 0;
+}
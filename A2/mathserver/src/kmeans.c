@@ -3,21 +3,30 @@
 #include <math.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define MAX_POINTS 4096 * 4096
 #define MAX_CLUSTERS 32 * 32
+#define MAX_DIMS 1024
 
-typedef struct point
-{
-    float x;     // The x-coordinate of the point
-    float y;     // The y-coordinate of the point
-    int cluster; // The cluster that the point belongs to
-} point;
+// Binary dataset file, see kmeans_kern.h
+#define KMEANS_FILE_MAGIC "KMDS"
+#define KMEANS_FILE_VERSION 1
+#define KMEANS_FILE_HDR 64
+#define KMEANS_FILE_CHECKSUM 1
 
-int N = 0;                   // number of entries in the data
-int k = 9;                   // number of centroids
-point data[MAX_POINTS];      // Data coordinates
-point cluster[MAX_CLUSTERS]; // The coordinates of each cluster center (also called centroid)
+int N = 0;            // number of entries in the data
+int D = 0;            // dimensions of a point, from the first line of the data
+int k = 9;            // number of centroids
+float *data;          // Data coordinates, point i at data[i * D]
+int *assign;          // The cluster that each point belongs to
+float *cluster;       // The coordinates of each cluster center (also called centroid), at cluster[c * D]
 
 // File paths
 char default_results_path[41] = "./../computed_results/kmeans-results.txt";
@@ -25,9 +34,105 @@ char default_input_path[64] = "./src/kmeans-data.txt";
 char *results_path = default_results_path;
 char *input_path = default_input_path;
 
-void read_data()
+// Read the numbers at the start of `line` into point[0..dims), 0 for those missing. Returns how many there were.
+int read_point(char *line, float *point, int dims)
+{
+    int n = 0;
+    for (char *end; n < dims; n++, line = end)
+    {
+        point[n] = strtof(line, &end);
+        if (end == line)
+            break;
+    }
+    for (int d = n; d < dims; d++)
+        point[d] = 0.0f;
+    return n;
+}
+
+// Little-endian field of a dataset file
+uint64_t get_le(const unsigned char *p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+// Read the points from input_path if it is a dataset file. Returns 0 if it is not one.
+int read_dataset()
 {
-    char line[256];
+    struct stat st;
+    int fd = open(input_path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size < 4)
+    {
+        if (fd != -1)
+            close(fd);
+        return 0;
+    }
+    const unsigned char *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+        return 0;
+    if (memcmp(buf, KMEANS_FILE_MAGIC, 4) != 0)
+    {
+        munmap((void *)buf, st.st_size);
+        return 0;
+    }
+
+    uint64_t n = 0, dims = 0, sum = 0xcbf29ce484222325ULL;
+    const unsigned char *col = buf + KMEANS_FILE_HDR;
+    if (st.st_size >= KMEANS_FILE_HDR)
+    {
+        n = get_le(buf + 8, 8);
+        dims = get_le(buf + 16, 4);
+    }
+    if (st.st_size < KMEANS_FILE_HDR || get_le(buf + 4, 4) != KMEANS_FILE_VERSION || n < 1 || n > MAX_POINTS ||
+        dims < 1 || dims > MAX_DIMS || (st.st_size - KMEANS_FILE_HDR) / sizeof(float) / dims < n)
+    {
+        fprintf(stderr, "Not a valid dataset file %s\n", input_path);
+        exit(EXIT_FAILURE);
+    }
+    if (get_le(buf + 20, 4) & KMEANS_FILE_CHECKSUM)
+    {
+        for (size_t i = 0; i < n * dims * sizeof(float); i++)
+            sum = (sum ^ col[i]) * 0x100000001b3ULL; // FNV-1a
+        if (sum != get_le(buf + 24, 8))
+        {
+            fprintf(stderr, "Checksum mismatch in %s\n", input_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The file has the points one dimension after the other
+    N = n;
+    D = dims;
+    data = malloc((size_t)N * D * sizeof(float));
+    assign = malloc(N * sizeof(int));
+    if (data == NULL || assign == NULL)
+    {
+        perror("Cannot allocate points");
+        exit(EXIT_FAILURE);
+    }
+    for (int d = 0; d < D; d++)
+    {
+        for (int i = 0; i < N; i++)
+        {
+            uint32_t bits = get_le(col + ((size_t)d * N + i) * sizeof(float), sizeof(float));
+            memcpy(&data[(size_t)i * D + d], &bits, sizeof(float));
+        }
+    }
+    for (int i = 0; i < N; i++)
+        assign[i] = -1;
+    munmap((void *)buf, st.st_size);
+    return 1;
+}
+
+// Read the points from input_path as text, D numbers per line
+void read_text()
+{
+    char *line = NULL;
+    size_t size = 0;
+    int cap = 0;
     FILE *fp;
     if ((fp = fopen(input_path, "r")) == NULL)
     {
@@ -36,28 +141,58 @@ void read_data()
     }
 
     // Initialize points from the data file
-    while (fgets(line, sizeof(line), fp))
+    while (getline(&line, &size, fp) != -1)
     {
         if (!isspace(line[0]) && N < MAX_POINTS) // Lines cannot start with whitespace
         {
-            char data_buf[256] = {0};
-            strncpy(data_buf, line, strlen(line) - 2);         // Copy everything except trailing '\n\0'
-            sscanf(data_buf, "%f %f", &data[N].x, &data[N].y); // Save to data array
-            data[N].cluster = -1;                              // Initialize the cluster number to -1
+            line[strcspn(line, "\r\n")] = '\0'; // Strip the line terminator
+            if (D == 0)
+            {
+                // The first line tells the dimensions, two if it is not a point at all
+                float first[MAX_DIMS];
+                D = read_point(line, first, MAX_DIMS);
+                if (D == 0)
+                    D = 2;
+            }
+            if (N == cap)
+            {
+                cap = cap ? 2 * cap : 1024;
+                data = realloc(data, (size_t)cap * D * sizeof(float));
+                assign = realloc(assign, cap * sizeof(int));
+                if (data == NULL || assign == NULL)
+                {
+                    perror("Cannot allocate points");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            read_point(line, &data[(size_t)N * D], D); // Save to data array
+            assign[N] = -1;                            // Initialize the cluster number to -1
             N++;
         }
     }
+    free(line);
+    fclose(fp);
+    if (N == 0)
+    {
+        fprintf(stderr, "No points in %s\n", input_path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void read_data()
+{
+    if (!read_dataset())
+        read_text();
 
     printf("Read the problem data!\n");
     // Initialize centroids randomly
+    cluster = malloc((size_t)k * D * sizeof(float));
     srand(0); // Setting 0 as the random number generation seed
     for (int i = 0; i < k; i++)
     {
         int r = rand() % N;
-        cluster[i].x = data[r].x;
-        cluster[i].y = data[r].y;
+        memcpy(&cluster[(size_t)i * D], &data[(size_t)r * D], D * sizeof(float));
     }
-    fclose(fp);
 }
 
 // Read command line arguments
@@ -111,14 +246,17 @@ int get_closest_centroid(int i, int k)
 {
     /* find the nearest centroid */
     int nearest_cluster = -1;
-    double xdist, ydist, dist, min_dist;
+    double xdist, dist, min_dist;
     min_dist = dist = INT_MAX;
     for (int c = 0; c < k; c++)
     { // For each centroid
         // Calculate the square of the Euclidean distance between that centroid and the point
-        xdist = data[i].x - cluster[c].x;
-        ydist = data[i].y - cluster[c].y;
-        dist = xdist * xdist + ydist * ydist; // The square of Euclidean distance
+        dist = 0.0;
+        for (int d = 0; d < D; d++)
+        {
+            xdist = data[(size_t)i * D + d] - cluster[(size_t)c * D + d];
+            dist += xdist * xdist; // The square of Euclidean distance
+        }
         // printf("%.2lf \n", dist);
         if (dist <= min_dist)
         {
@@ -136,9 +274,9 @@ bool assign_clusters_to_points()
     int old_cluster = -1, new_cluster = -1;
     for (int i = 0; i < N; i++)
     { // For each data point
-        old_cluster = data[i].cluster;
+        old_cluster = assign[i];
         new_cluster = get_closest_centroid(i, k);
-        data[i].cluster = new_cluster; // Assign a cluster to the point i
+        assign[i] = new_cluster; // Assign a cluster to the point i
         if (old_cluster != new_cluster)
         {
             something_changed = true;
@@ -147,25 +285,87 @@ bool assign_clusters_to_points()
     return something_changed;
 }
 
-void update_cluster_centers()
+/*
+ * Move the points farthest from their centers, farthest first, into the
+ * empty clusters, one each, out of the sums `temp` of their old ones. An
+ * empty cluster's center would be 0 / 0. Points on their center stay.
+ * Returns whether any point moved.
+ */
+bool relocate_empty_clusters(int count[], float *temp)
+{
+    bool moved = false;
+    float *dist = NULL;
+    for (int c = 0; c < k; c++)
+    {
+        if (count[c] > 0)
+            continue;
+        if (dist == NULL)
+        {
+            if ((dist = malloc(N * sizeof(float))) == NULL)
+                return moved;
+            for (int i = 0; i < N; i++)
+            {
+                double xdist, d2 = 0.0;
+                for (int d = 0; d < D; d++)
+                {
+                    xdist = data[(size_t)i * D + d] - cluster[(size_t)assign[i] * D + d];
+                    d2 += xdist * xdist;
+                }
+                dist[i] = d2;
+            }
+        }
+        int far = -1;
+        for (int i = 0; i < N; i++)
+        {
+            if (dist[i] > 0 && (far == -1 || dist[i] > dist[far]))
+                far = i;
+        }
+        if (far == -1)
+            break;
+        count[assign[far]]--;
+        count[c]++;
+        for (int d = 0; d < D; d++)
+        {
+            temp[(size_t)assign[far] * D + d] -= data[(size_t)far * D + d];
+            temp[(size_t)c * D + d] += data[(size_t)far * D + d];
+        }
+        assign[far] = c;
+        dist[far] = 0;
+        moved = true;
+    }
+    free(dist);
+    return moved;
+}
+
+// Returns whether a point moved into an empty cluster
+bool update_cluster_centers()
 {
     /* Update the cluster centers */
     int c;
-    int count[MAX_CLUSTERS] = {0}; // Array to keep track of the number of points in each cluster
-    point temp[MAX_CLUSTERS] = {0.0};
+    int *count = calloc(k, sizeof(int)); // Array to keep track of the number of points in each cluster
+    float *temp = calloc((size_t)k * D, sizeof(float));
+    if (count == NULL || temp == NULL)
+    {
+        perror("Cannot allocate cluster sums");
+        exit(EXIT_FAILURE);
+    }
 
     for (int i = 0; i < N; i++)
     {
-        c = data[i].cluster;
+        c = assign[i];
         count[c]++;
-        temp[c].x += data[i].x;
-        temp[c].y += data[i].y;
+        for (int d = 0; d < D; d++)
+            temp[(size_t)c * D + d] += data[(size_t)i * D + d];
     }
+    bool moved = relocate_empty_clusters(count, temp);
     for (int i = 0; i < k; i++)
     {
-        cluster[i].x = temp[i].x / count[i];
-        cluster[i].y = temp[i].y / count[i];
+        for (int d = 0; d < D && count[i] > 0; d++) // Still empty: the center stays
+            cluster[(size_t)i * D + d] = temp[(size_t)i * D + d] / count[i];
     }
+    free(temp);
+    free(count);
+    return moved;
 }
 
 int kmeans(int k)
@@ -176,7 +376,8 @@ int kmeans(int k)
     {
         iter++; // Keep track of number of iterations
         somechange = assign_clusters_to_points();
-        update_cluster_centers();
+        if (update_cluster_centers())
+            somechange = true;
     } while (somechange);
     printf("Number of iterations taken = %d\n", iter);
     printf("Computed cluster numbers successfully!\n");
@@ -192,8 +393,11 @@ void write_results()
     }
     for (int i = 0; i < N; i++)
     {
-        fprintf(fp, "%.2f %.2f %d\n", data[i].x, data[i].y, data[i].cluster);
+        for (int d = 0; d < D; d++)
+            fprintf(fp, "%.2f ", data[(size_t)i * D + d]);
+        fprintf(fp, "%d\n", assign[i]);
     }
+    fclose(fp);
     printf("Wrote the results to a file!\n");
 }
 
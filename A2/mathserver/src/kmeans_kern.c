@@ -0,0 +1,2442 @@
+/***************************************************************************
+ *
+ * Parallel Kmeans kernel (libmathkern)
+ * All state lives in a `struct kmeans`, so the server can run several
+ * problems at once in one process.
+ *
+ ***************************************************************************/
+
+#define _GNU_SOURCE // random_r
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "../include/kmeans_kern.h"
+#include "../include/fmt_util.h"
+#include "../include/numa_util.h"
+#include "../include/kmeans_simd.h"
+
+#define KMEANS_ALIGN 64  // Cache line
+#define KMEANS_CHUNK 256 // Points searched per call of the SIMD kernel
+#define KMEANS_LOAD_CHUNK (1 << 16) // Bytes of text, at least, per worker of kmeans_load()
+#define KMEANS_WRITE_BUF (1 << 20)  // Bytes of results, at most, each worker of kmeans_write() formats at a time
+#define FNV_OFFSET 0xcbf29ce484222325ULL  // FNV-1a of no bytes
+
+/*
+ * Hamerly and Elkan: bounds on the distances of the points to the
+ * centroids, shared by the workers. The distances are those in exact
+ * arithmetic; a centroid is only skipped if it is so much farther than
+ * the point's own that the float distances of the search cannot tie or
+ * cross either, so the assignments stay those of Lloyd.
+ */
+struct bounds
+{
+    double slack;    // Relative error of a float distance, and more
+    double far_u;    // bound_far(u) = u * far_u + far_0
+    double far_0;
+    double *upper;   // Per point: at least the distance to its centroid
+    double *lower;   // Per point: at most the distance to any other centroid
+    float *lowers;   // Elkan, per point: at most the distance to each centroid plus its total drift, N * k
+    double *drift;   // Per centroid: at least how far it moved in the last update
+    double *total;   // Elkan, per centroid: the sum of its drifts so far
+    float *ct;       // The centroids transposed, for kmeans_dists_fn
+    double *cc;      // Elkan: at most the distance between centroids a and c at cc[a * k + c]
+    double *s;       // Per centroid: at most the distance to the closest other centroid
+    double maxdrift; // The largest drift
+};
+
+// Holds the workers of a run back until all of them are created
+struct gate
+{
+    pthread_mutex_t lock; // Held while the workers are created
+    bool abort;           // One could not be, the others return at once
+};
+
+struct threadArgs
+{
+    struct kmeans *km;
+    unsigned int i;
+    int changed;                // This worker's points that changed cluster
+    struct kmeans *to;          // kmeans_place(): where to copy the points
+    pthread_barrier_t *barrier; // Passed twice per iteration by all workers
+    struct threadArgs *all;     // Every worker's arguments, for the reduction
+    double *sums;               // This worker's sums of the points per cluster, k * D of them
+    int *counts;                // The number of points in each of these sums
+    struct bounds *bounds;      // Hamerly and Elkan, NULL for Lloyd
+    long long distances;        // Point-centroid distances this worker computed
+    double shift;               // Squared moves of this worker's centroids, summed
+    double inertia;             // Traced: squared distances of own points to their centroids, summed
+    float *dist;                // Hamerly and Elkan: k distances of one point
+    struct seeding *seeding;    // kmeans_seed()
+    int *left;                  // Elkan: k centroids of one point
+    int *far;                   // Empty clusters: own points farthest from their centroid, farthest first
+    float *far_dist;            // Their squared distances
+    int nfar;
+    struct streaming *streaming; // kmeans_stream()
+    struct gate *gate;           // kmeans_cluster() and kmeans_stream(): wait here before the first barrier
+} __attribute__((aligned(KMEANS_ALIGN)));
+
+// A chunk of the text for kmeans_load()
+struct loadArgs
+{
+    struct kmeans *km;
+    const char *begin; // First line of the chunk
+    const char *end;   // After its last line
+    int count;         // Points in the chunk
+    int first;         // Index of its first point
+} __attribute__((aligned(KMEANS_ALIGN)));
+
+// A block of the results for kmeans_write()
+struct writeArgs
+{
+    struct kmeans *km;
+    int from, to;    // Points to format
+    int assignments; // Only their clusters
+    char *buf;
+    size_t len;      // Bytes formatted into buf
+} __attribute__((aligned(KMEANS_ALIGN)));
+
+// Forward declarations
+static void worker_rows(struct kmeans *km, int id, int *start, int *end);
+static void *copy_points(void *params);
+static void *seed_worker(void *params);
+static void *kmeans_worker(void *params);
+static void bounds_free(struct bounds *b);
+
+void kmeans_default_options(struct kmeans_options *opt)
+{
+    opt->k = 9;
+    opt->input_path = "./src/kmeans-data.txt";
+    opt->results_path = "./../computed_results/kmeans-results.txt";
+    opt->cpus = NULL;
+    opt->algorithm = KMEANS_LLOYD;
+    opt->init = KMEANS_INIT_RANDOM;
+    opt->batch = 0;
+    opt->passes = 1;
+    opt->tol = 0.0;
+    opt->max_iter = 0;
+    opt->trace_path = NULL;
+    opt->assignments = 0;
+}
+
+// Report an option given without its value, returns -1
+static int missing_value(char *prog, char *option)
+{
+    printf("%s: option -%s needs a value\n", prog, option);
+    return -1;
+}
+
+// Read command line arguments, returns -1 if an option is missing its value
+int kmeans_read_options(struct kmeans_options *opt, int argc, char *argv[])
+{
+    char *prog;
+    prog = *argv;
+
+    while (++argv, --argc > 0)
+        if (**argv == '-')
+            switch (*++*argv)
+            {
+            case 'f':
+                if (argc < 2)
+                    return missing_value(prog, *argv);
+                --argc;
+                opt->input_path = *++argv;
+                break;
+
+            case 'k':
+                if (argc < 2)
+                    return missing_value(prog, *argv);
+                --argc;
+                int value = atoi(*++argv);
+                if (value > MAX_CLUSTERS)
+                {
+                    opt->k = MAX_CLUSTERS;
+                }
+                else if (value < 1)
+                {
+                    opt->k = 1;
+                }
+                else
+                {
+                    opt->k = value;
+                }
+                break;
+
+            case 'p':
+                if (argc < 2)
+                    return missing_value(prog, *argv);
+                --argc;
+                // Where the server wants to save the results
+                opt->results_path = *++argv;
+                break;
+
+            case 'a':
+                if (argc < 2)
+                    return missing_value(prog, *argv);
+                --argc;
+                ++argv;
+                if (strcmp(*argv, "hamerly") == 0)
+                    opt->algorithm = KMEANS_HAMERLY;
+                else if (strcmp(*argv, "elkan") == 0)
+                    opt->algorithm = KMEANS_ELKAN;
+                else
+                    opt->algorithm = KMEANS_LLOYD;
+                break;
+
+            case 'i':
+                if (argc < 2)
+                    return missing_value(prog, *argv);
+                --argc;
+                ++argv;
+                if (strcmp(*argv, "kmeans++") == 0)
+                    opt->init = KMEANS_INIT_PLUSPLUS;
+                else if (strcmp(*argv, "kmeans||") == 0)
+                    opt->init = KMEANS_INIT_PARALLEL;
+                else
+                    opt->init = KMEANS_INIT_RANDOM;
+                break;
+
+            case '-':
+                if (strcmp(*argv, "-cpus") == 0)
+                {
+                    if (argc < 2)
+                        return missing_value(prog, *argv);
+                    --argc;
+                    opt->cpus = *++argv;
+                    break;
+                }
+                if (strcmp(*argv, "-batch") == 0)
+                {
+                    if (argc < 2)
+                        return missing_value(prog, *argv);
+                    --argc;
+                    long batch = atol(*++argv);
+                    opt->batch = (batch > MAX_POINTS) ? MAX_POINTS : (batch < 0) ? 0 : batch;
+                    break;
+                }
+                if (strcmp(*argv, "-tol") == 0)
+                {
+                    if (argc < 2)
+                        return missing_value(prog, *argv);
+                    --argc;
+                    double tol = atof(*++argv);
+                    opt->tol = (tol > 0.0) ? tol : 0.0;
+                    break;
+                }
+                if (strcmp(*argv, "-max-iter") == 0)
+                {
+                    if (argc < 2)
+                        return missing_value(prog, *argv);
+                    --argc;
+                    int max_iter = atoi(*++argv);
+                    opt->max_iter = (max_iter > 0) ? max_iter : 0;
+                    break;
+                }
+                if (strcmp(*argv, "-assignments") == 0)
+                {
+                    opt->assignments = 1;
+                    break;
+                }
+                if (strcmp(*argv, "-trace") == 0)
+                {
+                    if (argc < 2)
+                        return missing_value(prog, *argv);
+                    --argc;
+                    opt->trace_path = *++argv;
+                    break;
+                }
+                if (strcmp(*argv, "-passes") == 0)
+                {
+                    if (argc < 2)
+                        return missing_value(prog, *argv);
+                    --argc;
+                    int passes = atoi(*++argv);
+                    opt->passes = (passes < 1) ? 1 : passes;
+                    break;
+                }
+                // fall through
+
+            default:
+                printf("%s: ignored option: -%s\n", prog, *argv);
+                printf("\nUsage: kmeans\n");
+                printf("                [-f filename]    input data file\n");
+                printf("                [-k clusters]    number of clusters\n");
+                printf("                [-a algorithm]   lloyd, hamerly or elkan\n");
+                printf("                [-i seeding]     random, kmeans++ or 'kmeans||'\n");
+                printf("                [--cpus list]    pin the workers, e.g. 0-7,16-23\n");
+                printf("                [--batch points] mini-batches of this many points, streamed from the file\n");
+                printf("                [--passes n]     mini-batch passes over the file, 1 by default\n");
+                printf("                [--tol t]        stop once a fraction t of the points change cluster,\n");
+                printf("                                 or the centroids move little, e.g. 1e-4\n");
+                printf("                [--max-iter n]   stop after n iterations\n");
+                printf("                [--trace file]   write the iterations to file as JSON\n");
+                printf("                [--assignments]  write only the cluster of each point\n");
+                break;
+            }
+    return 0;
+}
+
+// Free the points and their clusters, or unmap the dataset file they are in
+static void free_points(struct kmeans *km)
+{
+    if (km->map != NULL)
+        munmap(km->map, km->map_len);
+    else
+        free(km->coords);
+    free(km->assign);
+    km->coords = NULL;
+    km->assign = NULL;
+    km->map = NULL;
+}
+
+/*
+ * Make room for `cap` points of km->D dimensions. Returns -1, leaving
+ * the points as they were, if memory is short.
+ */
+static int grow_points(struct kmeans *km, int cap)
+{
+    int *assign = realloc(km->assign, cap * sizeof(int));
+    if (assign == NULL)
+        return -1;
+    km->assign = assign;
+    float *coords = realloc(km->coords, (size_t)km->D * cap * sizeof(float));
+    if (coords == NULL)
+        return -1;
+
+    // Spread the dimensions out to the new stride, last first as they move up
+    for (int d = km->D - 1; d > 0; d--)
+        memmove(coords + (size_t)d * cap, coords + (size_t)d * km->cap, km->N * sizeof(float));
+    km->coords = coords;
+    km->cap = cap;
+    return 0;
+}
+
+/*
+ * The float at p (after any whitespace) in the text up to `end`, like
+ * strtof(). Returns where it ends, or p if there is none. Most numbers
+ * have few digits and a small exponent: they are converted with one
+ * float multiply or divide, which is exact rounding as both operands
+ * are exact. Any other number is left to strtof().
+ */
+static const char *parse_float(const char *p, const char *end, float *v)
+{
+    static const float pow10[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+    const char *s = p, *num;
+    bool neg = false, digits = false, fast = true;
+    long m = 0;
+    int e = 0;
+
+    while (s < end && isspace((unsigned char)*s))
+        s++;
+    if (s == end)
+        return p;
+    num = s;
+    if (*s == '-' || *s == '+')
+        neg = (*s++ == '-');
+    for (; s < end && isdigit((unsigned char)*s); s++, digits = true)
+    {
+        if (fast)
+            fast = (m = m * 10 + (*s - '0')) <= (1 << 24);
+    }
+    if (s < end && *s == '.')
+    {
+        for (s++; s < end && isdigit((unsigned char)*s); s++, digits = true, e--)
+        {
+            if (fast)
+                fast = (m = m * 10 + (*s - '0')) <= (1 << 24);
+        }
+    }
+    if (digits && s < end && (*s == 'e' || *s == 'E'))
+    {
+        const char *x = s + 1;
+        bool eneg = false;
+        int exp = 0;
+        if (x < end && (*x == '-' || *x == '+'))
+            eneg = (*x++ == '-');
+        if (x < end && isdigit((unsigned char)*x))
+        {
+            for (; x < end && isdigit((unsigned char)*x); x++)
+                exp = (exp < 1000) ? exp * 10 + (*x - '0') : exp;
+            e += eneg ? -exp : exp;
+            s = x;
+        }
+    }
+    // Hex, inf, nan, long mantissas and the like
+    if (!fast || !digits || e < -10 || e > 10 || (s < end && (isalpha((unsigned char)*s) || *s == '.')))
+    {
+        char small[64], *copy = small, *stop;
+        size_t n = 0;
+        while (num + n < end && !isspace((unsigned char)num[n]))
+            n++;
+        if (n >= sizeof(small) && (copy = malloc(n + 1)) == NULL)
+            return p;
+        memcpy(copy, num, n);
+        copy[n] = '\0';
+        *v = strtof(copy, &stop);
+        s = (stop == copy) ? p : num + (stop - copy);
+        if (copy != small)
+            free(copy);
+        return s;
+    }
+    *v = (e < 0) ? (float)m / pow10[-e] : (float)m * pow10[e];
+    if (neg)
+        *v = -*v;
+    return s;
+}
+
+/*
+ * The numbers at the start of `line`, up to `end`, into point[0..D), 0
+ * for those missing. Returns how many there were, up to `max`.
+ */
+static int parse_point(const char *line, const char *end, float *point, int D, size_t stride, int max)
+{
+    int n = 0;
+    for (const char *next; n < max; n++, line = next)
+    {
+        float v;
+        next = parse_float(line, end, &v);
+        if (next == line)
+            break;
+        if (n < D)
+            point[n * stride] = v;
+    }
+    for (int d = n; d < D; d++)
+        point[d * stride] = 0.0f;
+    return n;
+}
+
+// The line after the one at `line`, or `end`
+static inline const char *next_line(const char *line, const char *end)
+{
+    const char *eol = memchr(line, '\n', end - line);
+    return (eol == NULL) ? end : eol + 1;
+}
+
+/*
+ * Worker of kmeans_load(): count the points in its chunk of the text,
+ * then, once they have room, parse them. Points are the lines that do not
+ * start with whitespace, so blank lines and CRLF endings are fine.
+ */
+static void *count_points(void *params)
+{
+    struct loadArgs *args = (struct loadArgs *)params;
+    int count = 0; // Not in args: isspace() is a call, args->count would be stored for every line
+    for (const char *line = args->begin; line < args->end; line = next_line(line, args->end))
+    {
+        if (!isspace((unsigned char)line[0]))
+            count++;
+    }
+    args->count = count;
+    return NULL;
+}
+
+static void *parse_points(void *params)
+{
+    struct loadArgs *args = (struct loadArgs *)params;
+    struct kmeans *km = args->km;
+    int i = args->first;
+    for (const char *line = args->begin, *next; line < args->end && i < km->N; line = next)
+    {
+        next = next_line(line, args->end);
+        if (isspace((unsigned char)line[0]))
+            continue;
+        parse_point(line, next, km->coords + i, km->D, km->cap, km->D);
+        km->assign[i] = -1; // Initialize the cluster number to -1
+        i++;
+    }
+    return NULL;
+}
+
+// Run `fn` on each of the n chunks, here for those no thread could be started for
+static void run_chunks(struct loadArgs *args, int n, void *(*fn)(void *))
+{
+    pthread_t children[KMEANS_THREADS];
+    bool started[KMEANS_THREADS] = {false};
+    for (int t = 1; t < n; t++)
+    {
+        started[t] = (pthread_create(&children[t], NULL, fn, &args[t]) == 0);
+        if (!started[t])
+            fn(&args[t]);
+    }
+    fn(&args[0]);
+    for (int t = 1; t < n; t++)
+    {
+        if (started[t])
+            pthread_join(children[t], NULL);
+    }
+}
+
+// Initialize `k` centroids randomly, same sequence as srand(0); rand() but private to this problem
+static int init_centroids(struct kmeans *km, int k)
+{
+    struct random_data rnd;
+    char state[128];
+    int32_t r;
+    memset(&rnd, 0, sizeof(rnd));
+    initstate_r(0, state, sizeof(state), &rnd);
+
+    km->centroid = calloc((size_t)k * km->D, sizeof(float));
+    if (km->centroid == NULL)
+        return -1;
+    for (int i = 0; i < k; i++)
+    {
+        random_r(&rnd, &r);
+        r = r % km->N;
+        for (int d = 0; d < km->D; d++)
+            km->centroid[(size_t)i * km->D + d] = km->coords[(size_t)d * km->cap + r];
+    }
+    return 0;
+}
+
+// Little-endian field of a dataset file header
+static uint64_t get_le(const unsigned char *p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static void put_le(unsigned char *p, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+// FNV-1a of `len` bytes, going on from `h`: the checksum of a dataset file
+static uint64_t fnv1a(uint64_t h, const unsigned char *p, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+/*
+ * Set up the problem from a dataset file (format in kmeans_kern.h) that
+ * is `len` bytes at `buf`. With `map`, buf is a mapping of the file that
+ * the problem keeps and reads the columns from; else they are copied.
+ * Returns -1 with errno EINVAL if it is not a valid dataset.
+ */
+static int load_dataset(struct kmeans *km, const char *buf, size_t len, int k, bool map)
+{
+    const unsigned char *hdr = (const unsigned char *)buf;
+    uint64_t N = 0;
+    uint32_t D = 0, flags = 0;
+
+    memset(km, 0, sizeof(struct kmeans));
+    km->k = k;
+    if (len >= KMEANS_FILE_HDR)
+    {
+        N = get_le(hdr + 8, 8);
+        D = get_le(hdr + 16, 4);
+        flags = get_le(hdr + 20, 4);
+    }
+    if (len < KMEANS_FILE_HDR || get_le(hdr + 4, 4) != KMEANS_FILE_VERSION || N < 1 || N > MAX_POINTS ||
+        D < 1 || D > MAX_DIMS || (len - KMEANS_FILE_HDR) / sizeof(float) / D < N ||
+        ((flags & KMEANS_FILE_CHECKSUM) &&
+         fnv1a(FNV_OFFSET, hdr + KMEANS_FILE_HDR, N * D * sizeof(float)) != get_le(hdr + 24, 8)))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    km->N = N;
+    km->D = D;
+    if (map && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    {
+        km->assign = malloc(N * sizeof(int));
+        if (km->assign == NULL)
+            return -1;
+        km->map = (void *)buf;
+        km->map_len = len;
+        km->coords = (float *)(buf + KMEANS_FILE_HDR);
+        km->cap = N;
+    }
+    else
+    {
+        km->N = 0;
+        if (grow_points(km, N) == -1)
+        {
+            kmeans_free(km);
+            return -1;
+        }
+        km->N = N;
+        for (size_t j = 0; j < N * D; j++)
+        {
+            uint32_t bits = get_le(hdr + KMEANS_FILE_HDR + j * sizeof(float), sizeof(float));
+            memcpy(&km->coords[j], &bits, sizeof(float));
+        }
+        if (map)
+            munmap((void *)buf, len);
+    }
+    for (size_t i = 0; i < N; i++)
+        km->assign[i] = -1; // Initialize the cluster number to -1
+    return init_centroids(km, k);
+}
+
+/*
+ * Read the points in text `buf` (D numbers per line, D being how many the
+ * first line has), or in a dataset file, and initialize `k` centroids. The text is split into
+ * chunks at line ends, which the workers count and then parse in place.
+ * Returns -1 if there are no points.
+ */
+int kmeans_load(struct kmeans *km, const char *buf, size_t len, int k)
+{
+    const char *line = buf, *end = buf + len;
+    struct loadArgs args[KMEANS_THREADS];
+    int chunks = (len / KMEANS_LOAD_CHUNK < KMEANS_THREADS) ? len / KMEANS_LOAD_CHUNK + 1 : KMEANS_THREADS;
+    long N = 0;
+
+    if (len >= 4 && memcmp(buf, KMEANS_FILE_MAGIC, 4) == 0)
+        return load_dataset(km, buf, len, k, false);
+
+    memset(km, 0, sizeof(struct kmeans));
+    km->k = k;
+
+    // The first line tells the dimensions, two if it is not a point at all
+    while (line < end && isspace((unsigned char)line[0]))
+        line = next_line(line, end);
+    if (line == end)
+        return -1;
+    float first[MAX_DIMS];
+    km->D = parse_point(line, next_line(line, end), first, MAX_DIMS, 1, MAX_DIMS);
+    if (km->D == 0)
+        km->D = 2;
+
+    for (int t = 0; t < chunks; t++)
+    {
+        args[t].km = km;
+        args[t].begin = (t == 0) ? buf : args[t - 1].end;
+        args[t].end = (t == chunks - 1) ? end : buf + len / chunks * (t + 1);
+        if (args[t].end < args[t].begin)
+            args[t].end = args[t].begin;
+        else if (args[t].end > buf && args[t].end < end && args[t].end[-1] != '\n')
+            args[t].end = next_line(args[t].end, end);
+    }
+    run_chunks(args, chunks, count_points);
+    for (int t = 0; t < chunks; t++)
+    {
+        args[t].first = N;
+        N += args[t].count;
+    }
+    if (grow_points(km, (N < MAX_POINTS) ? N : MAX_POINTS) == -1)
+    {
+        kmeans_free(km);
+        return -1;
+    }
+    km->N = km->cap;
+    run_chunks(args, chunks, parse_points);
+
+    return init_centroids(km, k);
+}
+
+/*
+ * Read data from input file `path` and initialize centroids.
+ * Returns -1 (with errno set if the file could not be read) on failure.
+ */
+int kmeans_load_file(struct kmeans *km, const char *path, int k)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        memset(km, 0, sizeof(struct kmeans));
+        return -1;
+    }
+
+    char *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+    {
+        return -1;
+    }
+    // A dataset file stays mapped, its columns are the points
+    if (st.st_size >= 4 && memcmp(buf, KMEANS_FILE_MAGIC, 4) == 0)
+    {
+        int rc = load_dataset(km, buf, st.st_size, k, true);
+        if (rc == -1 && km->map == NULL && km->coords == NULL)
+            munmap(buf, st.st_size);
+        return rc;
+    }
+    int rc = kmeans_load(km, buf, st.st_size, k);
+    munmap(buf, st.st_size);
+    return rc;
+}
+
+/*
+ * Write the points as a dataset file (format in kmeans_kern.h), with
+ * their checksum if `checksum`. Returns -1 if writing fails.
+ */
+int kmeans_save(struct kmeans *km, FILE *fp, int checksum)
+{
+    unsigned char hdr[KMEANS_FILE_HDR] = {0};
+    uint64_t h = FNV_OFFSET;
+
+    for (int pass = checksum ? 0 : 1; pass < 2; pass++)
+    {
+        if (pass == 1)
+        {
+            memcpy(hdr, KMEANS_FILE_MAGIC, 4);
+            put_le(hdr + 4, KMEANS_FILE_VERSION, 4);
+            put_le(hdr + 8, km->N, 8);
+            put_le(hdr + 16, km->D, 4);
+            put_le(hdr + 20, checksum ? KMEANS_FILE_CHECKSUM : 0, 4);
+            put_le(hdr + 24, checksum ? h : 0, 8);
+            fwrite(hdr, 1, sizeof(hdr), fp);
+        }
+        // First pass sums up the columns, second writes them
+        for (int d = 0; d < km->D; d++)
+        {
+            const float *x = km->coords + (size_t)d * km->cap;
+            if (pass == 1 && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+            {
+                fwrite(x, sizeof(float), km->N, fp);
+                continue;
+            }
+            if (pass == 0 && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+            {
+                h = fnv1a(h, (const unsigned char *)x, km->N * sizeof(float));
+                continue;
+            }
+            for (int i = 0; i < km->N; i++)
+            {
+                unsigned char le[sizeof(float)];
+                uint32_t bits;
+                memcpy(&bits, &x[i], sizeof(bits));
+                put_le(le, bits, sizeof(le));
+                if (pass == 0)
+                    h = fnv1a(h, le, sizeof(le));
+                else
+                    fwrite(le, 1, sizeof(le), fp);
+            }
+        }
+    }
+    return (fflush(fp) == 0 && !ferror(fp)) ? 0 : -1;
+}
+
+/*
+ * NUMA: pin the workers to the CPUs in list `cpus` and move each
+ * worker's block of points into memory it touches first, so that it is
+ * on its own node. Reports where the points are to `out` if not NULL.
+ * Returns -1 if the list is bad or memory is short.
+ */
+int kmeans_place(struct kmeans *km, const char *cpus, FILE *out)
+{
+    pthread_t children[KMEANS_THREADS];
+    struct threadArgs args[KMEANS_THREADS];
+    bool started[KMEANS_THREADS];
+    pthread_attr_t attr;
+
+    if ((km->ncpus = cpulist_parse(cpus, &km->cpus)) == -1)
+    {
+        km->ncpus = 0;
+        km->cpus = NULL;
+        return -1;
+    }
+    // Untouched: malloc maps blocks this large fresh from the kernel
+    struct kmeans to = {0};
+    to.D = km->D;
+    if (grow_points(&to, km->N) == -1)
+    {
+        free(to.assign);
+        return -1;
+    }
+
+    for (int i = 0; i < KMEANS_THREADS; i++)
+    {
+        args[i].km = km;
+        args[i].i = i;
+        args[i].to = &to;
+        pthread_attr_init(&attr);
+        pin_attr(&attr, km->cpus[i % km->ncpus]);
+        started[i] = (pthread_create(&children[i], &attr, copy_points, &args[i]) == 0);
+        pthread_attr_destroy(&attr);
+        if (!started[i])
+            copy_points(&args[i]); // Not on its node, but copied
+    }
+    for (int i = 0; i < KMEANS_THREADS; i++)
+    {
+        if (started[i])
+            pthread_join(children[i], NULL);
+    }
+    free_points(km);
+    km->coords = to.coords;
+    km->assign = to.assign;
+    km->cap = to.cap;
+
+    if (out != NULL)
+        numa_report(out, "points", km->coords, (size_t)km->D * km->cap * sizeof(float));
+    return 0;
+}
+
+// Worker of kmeans_place(): copy own points
+static void *copy_points(void *params)
+{
+    struct threadArgs *args = (struct threadArgs *)params;
+    struct kmeans *km = args->km, *to = args->to;
+    int start, end;
+    worker_rows(km, args->i, &start, &end);
+    for (int d = 0; d < km->D; d++)
+    {
+        memcpy(to->coords + (size_t)d * to->cap + start, km->coords + (size_t)d * km->cap + start,
+               (end - start) * sizeof(float));
+    }
+    memcpy(to->assign + start, km->assign + start, (end - start) * sizeof(int));
+    return NULL;
+}
+
+/*
+ * Seeding, shared by the workers of kmeans_seed(). Each draw is a hash of
+ * KMEANS_SEED, the round and the point, and all sums are added up in
+ * worker order, so the centroids do not depend on the thread timing.
+ */
+// What one worker of kmeans_seed() shares, on its own cache line
+struct seedSlot
+{
+    double partial; // The sum of the dist of its points
+    int *picked;    // kmeans||: its points drawn in a round
+    int npicked;
+    int *counts;    // kmeans||: its points closest to each candidate
+} __attribute__((aligned(KMEANS_ALIGN)));
+
+struct seeding
+{
+    int init;    // KMEANS_INIT_PLUSPLUS or KMEANS_INIT_PARALLEL
+    float *dist; // Per point: squared distance to the closest center so far
+    float *cand; // kmeans||: the candidate centers, ncand * D
+    int ncand, cand_cap;
+    bool failed; // Memory was short
+    struct seedSlot slot[KMEANS_THREADS];
+};
+
+// Uniform in [0, 1), draw `n` of round `round` (splitmix64)
+static double seed_uniform(uint64_t round, uint64_t n)
+{
+    uint64_t z = (KMEANS_SEED + round * 0xd1b54a32d192ed03ULL) ^ (n * 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return (z >> 11) * 0x1.0p-53;
+}
+
+/*
+ * The point where the running sum of dist, in worker order, passes r.
+ * The last point with a distance if rounding leaves r unspent.
+ */
+static int seed_pick(struct kmeans *km, struct seeding *s, double r)
+{
+    int t = 0, start, end;
+    while (t < KMEANS_THREADS - 1 && r >= s->slot[t].partial)
+        r -= s->slot[t++].partial;
+    worker_rows(km, t, &start, &end);
+    for (int i = start; i < end; i++)
+    {
+        if ((r -= s->dist[i]) < 0)
+            return i;
+    }
+    for (int i = km->N - 1; i > 0; i--)
+    {
+        if (s->dist[i] > 0)
+            return i;
+    }
+    return 0;
+}
+
+static void set_centroid(struct kmeans *km, int c, int point)
+{
+    for (int d = 0; d < km->D; d++)
+        km->centroid[(size_t)c * km->D + d] = km->coords[(size_t)d * km->cap + point];
+}
+
+/*
+ * kmeans++, one centroid per round: the workers fold the last centroid
+ * into the distances of their points, then worker 0 draws the next one.
+ */
+static void seed_plusplus(struct threadArgs *args)
+{
+    struct kmeans *km = args->km;
+    struct seeding *s = args->seeding;
+    int start, end;
+    worker_rows(km, args->i, &start, &end);
+
+    for (int c = 0; c < km->k; c++)
+    {
+        if (c > 0)
+        {
+            const float *m = km->centroid + (size_t)(c - 1) * km->D;
+            double sum = 0.0;
+            for (int i = start; i < end; i++)
+            {
+                float dist = kmeans_dist(km->coords + i, km->cap, km->D, m);
+                if (c == 1 || dist < s->dist[i])
+                    s->dist[i] = dist;
+                sum += s->dist[i];
+            }
+            s->slot[args->i].partial = sum;
+        }
+        pthread_barrier_wait(args->barrier);
+        if (args->i == 0)
+        {
+            double total = 0.0;
+            for (int t = 0; c > 0 && t < KMEANS_THREADS; t++)
+                total += s->slot[t].partial;
+            if (total > 0.0)
+                set_centroid(km, c, seed_pick(km, s, seed_uniform(c, 0) * total));
+            else // First one, or all points are on a centroid
+                set_centroid(km, c, (int)(seed_uniform(c, 0) * km->N));
+        }
+        pthread_barrier_wait(args->barrier);
+    }
+}
+
+/*
+ * kmeans||: fold candidates [from, to) into the distances of own points,
+ * returning their sum. With counts, count own points per closest candidate.
+ */
+static double seed_fold(struct threadArgs *args, int from, int to, int *counts)
+{
+    struct kmeans *km = args->km;
+    struct seeding *s = args->seeding;
+    kmeans_nearest_fn nearest = kmeans_nearest(km->D);
+    int near[KMEANS_CHUNK], start, end;
+    double sum = 0.0;
+    worker_rows(km, args->i, &start, &end);
+
+    for (int i0 = start; i0 < end; i0 += KMEANS_CHUNK)
+    {
+        int n = (end - i0 < KMEANS_CHUNK) ? end - i0 : KMEANS_CHUNK;
+        const float *cand = s->cand + (size_t)from * km->D;
+        nearest(km->coords + i0, km->cap, n, km->D, cand, to - from, near);
+        for (int j = 0; j < n; j++)
+        {
+            if (counts != NULL)
+            {
+                counts[near[j]]++;
+                continue;
+            }
+            float dist = kmeans_dist(km->coords + i0 + j, km->cap, km->D, cand + (size_t)near[j] * km->D);
+            if (from == 0 || dist < s->dist[i0 + j])
+                s->dist[i0 + j] = dist;
+            sum += s->dist[i0 + j];
+        }
+    }
+    return sum;
+}
+
+// kmeans||: add point i to the candidates
+static void seed_candidate(struct kmeans *km, struct seeding *s, int i)
+{
+    if (s->ncand == s->cand_cap)
+    {
+        int cap = s->cand_cap ? 2 * s->cand_cap : 4 * km->k;
+        float *cand = realloc(s->cand, (size_t)cap * km->D * sizeof(float));
+        if (cand == NULL)
+        {
+            s->failed = true;
+            return;
+        }
+        s->cand = cand;
+        s->cand_cap = cap;
+    }
+    for (int d = 0; d < km->D; d++)
+        s->cand[(size_t)s->ncand * km->D + d] = km->coords[(size_t)d * km->cap + i];
+    s->ncand++;
+}
+
+/*
+ * kmeans||, worker 0: kmeans++ over the candidates, each weighted by the
+ * points closest to it, for the k centroids.
+ */
+static void seed_weighted(struct kmeans *km, struct seeding *s)
+{
+    int M = s->ncand, D = km->D;
+    double *weight = calloc(M, sizeof(double));
+    float *dist = malloc(M * sizeof(float));
+    if (weight == NULL || dist == NULL)
+    {
+        s->failed = true;
+        free(weight);
+        free(dist);
+        return;
+    }
+    for (int t = 0; t < KMEANS_THREADS; t++)
+    {
+        for (int c = 0; c < M; c++)
+            weight[c] += s->slot[t].counts[c];
+    }
+
+    for (int c = 0; c < km->k; c++)
+    {
+        double total = 0.0, r;
+        int pick = M - 1;
+        for (int j = 0; j < M; j++)
+        {
+            if (c > 0)
+            {
+                float d = kmeans_dist(s->cand + (size_t)j * D, 1, D, km->centroid + (size_t)(c - 1) * D);
+                if (c == 1 || d < dist[j])
+                    dist[j] = d;
+            }
+            total += (c > 0) ? weight[j] * dist[j] : weight[j];
+        }
+        r = seed_uniform(KMEANS_PAR_ROUNDS + 1 + c, 0) * total;
+        for (int j = 0; j < M && total > 0.0; j++)
+        {
+            if ((r -= (c > 0) ? weight[j] * dist[j] : weight[j]) < 0)
+            {
+                pick = j;
+                break;
+            }
+        }
+        memcpy(km->centroid + (size_t)c * D, s->cand + (size_t)pick * D, D * sizeof(float));
+    }
+    free(weight);
+    free(dist);
+}
+
+/*
+ * kmeans|| (Bahmani et al., 2012): starting from one random point, each
+ * round draws every point with probability 2k times its squared distance
+ * over their sum, all workers at once, then reduces the candidates to k.
+ */
+static void seed_parallel(struct threadArgs *args)
+{
+    struct kmeans *km = args->km;
+    struct seeding *s = args->seeding;
+    int start, end, done = 0;
+    worker_rows(km, args->i, &start, &end);
+
+    if (args->i == 0)
+        seed_candidate(km, s, (int)(seed_uniform(0, 0) * km->N));
+    pthread_barrier_wait(args->barrier);
+
+    for (int round = 1; round <= KMEANS_PAR_ROUNDS; round++)
+    {
+        int added = s->ncand;
+        s->slot[args->i].partial = seed_fold(args, done, added, NULL);
+        done = added;
+        pthread_barrier_wait(args->barrier);
+
+        double total = 0.0;
+        for (int t = 0; t < KMEANS_THREADS; t++)
+            total += s->slot[t].partial;
+        int npicked = 0;
+        for (int i = start; i < end && total > 0.0; i++)
+        {
+            if (seed_uniform(round, i) * total < 2.0 * km->k * s->dist[i])
+                s->slot[args->i].picked[npicked++] = i;
+        }
+        s->slot[args->i].npicked = npicked;
+        pthread_barrier_wait(args->barrier);
+
+        if (args->i == 0)
+        {
+            for (int t = 0; t < KMEANS_THREADS; t++)
+            {
+                for (int j = 0; j < s->slot[t].npicked; j++)
+                    seed_candidate(km, s, s->slot[t].picked[j]);
+            }
+        }
+        pthread_barrier_wait(args->barrier);
+    }
+
+    // Too few distinct points for kmeans|| to find k, plain kmeans++ then
+    if (s->ncand < km->k || s->failed)
+    {
+        seed_plusplus(args);
+        return;
+    }
+    s->slot[args->i].counts = calloc(s->ncand, sizeof(int));
+    if (s->slot[args->i].counts == NULL)
+        s->failed = true;
+    else
+        seed_fold(args, 0, s->ncand, s->slot[args->i].counts);
+    pthread_barrier_wait(args->barrier);
+    if (args->i == 0 && !s->failed)
+        seed_weighted(km, s);
+}
+
+// Wait for the gate to open. Returns false if the run is abandoned.
+static bool gate_pass(struct gate *g)
+{
+    pthread_mutex_lock(&g->lock);
+    bool go = !g->abort;
+    pthread_mutex_unlock(&g->lock);
+    return go;
+}
+
+/*
+ * Start `worker` on each of the KMEANS_THREADS `args`, held at the gate
+ * until all are created. Returns how many were, all of them unless one
+ * failed (errno set); those few then return at once and are joined.
+ */
+static int start_workers(struct kmeans *km, pthread_t children[], struct threadArgs args[], void *(*worker)(void *))
+{
+    struct gate *gate = args[0].gate;
+    pthread_attr_t attr;
+    int n;
+
+    pthread_mutex_lock(&gate->lock);
+    for (n = 0; n < KMEANS_THREADS; n++)
+    {
+        pthread_attr_init(&attr);
+        if (km->cpus != NULL)
+            pin_attr(&attr, km->cpus[n % km->ncpus]);
+        int err = pthread_create(&(children[n]),    // Our handle for the child
+                                 &attr,             // Attributes of the child
+                                 worker,            // The function it should run
+                                 (void *)&args[n]); // Args to that function
+        pthread_attr_destroy(&attr);
+        if (err != 0)
+        {
+            gate->abort = true;
+            errno = err;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gate->lock);
+    return n;
+}
+
+static void *seed_worker(void *params)
+{
+    struct threadArgs *args = (struct threadArgs *)params;
+    if (!gate_pass(args->gate))
+        return NULL;
+    if (args->seeding->init == KMEANS_INIT_PARALLEL)
+        seed_parallel(args);
+    else
+        seed_plusplus(args);
+    return NULL;
+}
+
+/*
+ * Replace the random centroids by those of kmeans++ or kmeans||
+ * (KMEANS_INIT_*), computed on the workers. Returns -1, leaving the
+ * centroids as they were, if memory is short or the workers cannot all
+ * be started.
+ */
+int kmeans_seed(struct kmeans *km, int init)
+{
+    pthread_t children[KMEANS_THREADS];
+    struct threadArgs args[KMEANS_THREADS];
+    pthread_barrier_t barrier;
+    struct gate gate = {PTHREAD_MUTEX_INITIALIZER, false};
+    struct seeding s = {0};
+    int start, end;
+
+    if (init == KMEANS_INIT_RANDOM)
+        return 0;
+    s.init = init;
+    float *saved = malloc((size_t)km->k * km->D * sizeof(float));
+    s.dist = malloc(km->N * sizeof(float));
+    for (int t = 0; t < KMEANS_THREADS && init == KMEANS_INIT_PARALLEL; t++)
+    {
+        worker_rows(km, t, &start, &end);
+        if ((s.slot[t].picked = malloc((end - start + 1) * sizeof(int))) == NULL)
+            s.failed = true;
+    }
+    if (saved == NULL || s.dist == NULL || s.failed)
+    {
+        s.failed = true;
+    }
+    else
+    {
+        memcpy(saved, km->centroid, (size_t)km->k * km->D * sizeof(float));
+        pthread_barrier_init(&barrier, NULL, KMEANS_THREADS);
+        for (int i = 0; i < KMEANS_THREADS; i++)
+        {
+            args[i].km = km;
+            args[i].i = i;
+            args[i].barrier = &barrier;
+            args[i].seeding = &s;
+            args[i].gate = &gate;
+        }
+        int started = start_workers(km, children, args, seed_worker);
+        for (int i = 0; i < started; i++)
+        {
+            pthread_join(children[i], NULL);
+        }
+        pthread_barrier_destroy(&barrier);
+        if (gate.abort)
+            s.failed = true;
+        if (s.failed)
+            memcpy(km->centroid, saved, (size_t)km->k * km->D * sizeof(float));
+    }
+
+    for (int t = 0; t < KMEANS_THREADS; t++)
+    {
+        free(s.slot[t].picked);
+        free(s.slot[t].counts);
+    }
+    free(s.cand);
+    free(s.dist);
+    free(saved);
+    return s.failed ? -1 : 0;
+}
+
+// The points of worker `id`, end not inclusive
+static void worker_rows(struct kmeans *km, int id, int *start, int *end)
+{
+    *start = (km->N / KMEANS_THREADS) * id;
+    *end = *start + (km->N / KMEANS_THREADS);
+
+    if (id == KMEANS_THREADS - 1)
+    {
+        *end = km->N;
+    }
+}
+
+/*
+ * Assign the n points at x (coordinate d of point j at x[d * stride + j])
+ * to their nearest centroid near[j], and add them to the sums and counts
+ * of those. Returns how many points changed cluster.
+ */
+static inline __attribute__((always_inline)) int assign_points_body(const float *x, size_t stride, int n, int D,
+                                                                     const int *near, int *assign, double *sums,
+                                                                     int *counts)
+{
+    int changed = 0;
+    for (int j = 0; j < n; j++)
+    { // For each data point
+        if (assign[j] != near[j])
+        {
+            assign[j] = near[j]; // Assign a cluster to the point j
+            changed++;
+        }
+        if (near[j] >= 0)
+        {
+            double *sum = sums + (size_t)near[j] * D;
+            counts[near[j]]++;
+            for (int d = 0; d < D; d++)
+                sum[d] += x[d * stride + j];
+        }
+    }
+    return changed;
+}
+
+// assign_points_body() with the common D as constants, like the searches in kmeans_simd.c
+static int assign_points(const float *x, size_t stride, int n, int D, const int *near, int *assign,
+                         double *sums, int *counts)
+{
+    switch (D)
+    {
+#define ASSIGN_D(d) \
+    case d:         \
+        return assign_points_body(x, stride, n, d, near, assign, sums, counts);
+        ASSIGN_D(2)
+        ASSIGN_D(3)
+        ASSIGN_D(4)
+        ASSIGN_D(8)
+        ASSIGN_D(16)
+        ASSIGN_D(32)
+        ASSIGN_D(64)
+#undef ASSIGN_D
+    default:
+        return assign_points_body(x, stride, n, D, near, assign, sums, counts);
+    }
+}
+
+/*
+ * Hamerly and Elkan: how far a centroid must be from a point, at least,
+ * to be certainly not nearer to it than its own, at most `u` away, once
+ * both distances are computed in float. Ties are never skipped.
+ */
+static inline double bound_far(const struct bounds *b, double u)
+{
+    return u * b->far_u + b->far_0;
+}
+
+// `lower` as a float that is not larger
+static inline float round_down(double lower)
+{
+    float f = (float)lower;
+    return (f > lower) ? nextafterf(f, -INFINITY) : f;
+}
+
+/*
+ * Hamerly and Elkan: all the distances of point i, the one at x, for its
+ * first bounds. Returns the nearest centroid like the search does.
+ */
+static int bound_scan(struct threadArgs *args, const float *x, int i)
+{
+    struct kmeans *km = args->km;
+    struct bounds *b = args->bounds;
+    float best = INFINITY, second = INFINITY;
+    float *dist = args->dist;
+    int a = -1;
+
+    kmeans_simd()->dists(x, km->cap, km->D, b->ct, km->k, dist);
+    for (int c = 0; c < km->k; c++)
+    {
+        if (dist[c] <= best)
+        {
+            second = best;
+            best = dist[c];
+            a = c;
+        }
+        else if (dist[c] < second)
+        {
+            second = dist[c];
+        }
+        if (b->lowers != NULL)
+            b->lowers[(size_t)i * km->k + c] = round_down(sqrt(dist[c]) * (1.0 - b->slack) + b->total[c]);
+    }
+    args->distances += km->k;
+    b->upper[i] = sqrt(best) * (1.0 + b->slack);
+    b->lower[i] = sqrt(second) * (1.0 - b->slack);
+    return a;
+}
+
+/*
+ * Hamerly: the nearest centroid of point i, the one at x, skipping the
+ * search while its bounds show its centroid is still the nearest.
+ */
+static int hamerly_point(struct threadArgs *args, const float *x, int i)
+{
+    struct kmeans *km = args->km;
+    struct bounds *b = args->bounds;
+    int a = km->assign[i];
+    if (a < 0)
+        return bound_scan(args, x, i);
+
+    double u = b->upper[i] + b->drift[a];
+    double l = b->lower[i] - b->maxdrift;
+    b->upper[i] = u;
+    b->lower[i] = l;
+    if (fmax(l, b->s[a] - u) > bound_far(b, u))
+        return a;
+
+    // Tighten the upper bound and try again
+    u = sqrt(kmeans_dist(x, km->cap, km->D, km->centroid + (size_t)a * km->D)) * (1.0 + b->slack);
+    args->distances++;
+    b->upper[i] = u;
+    if (fmax(l, b->s[a] - u) > bound_far(b, u))
+        return a;
+    return bound_scan(args, x, i);
+}
+
+/*
+ * Elkan: the nearest centroid of point i, the one at x, only computing
+ * the distances to the centroids its bounds cannot rule out. Hamerly's
+ * single lower bound is tried first, it rules out all of them at once
+ * for most points. The lower bounds per centroid are kept with the total
+ * drift of the centroid added, so they need no update in the iterations
+ * the point is not looked at.
+ */
+static int elkan_point(struct threadArgs *args, const float *x, int i)
+{
+    struct kmeans *km = args->km;
+    struct bounds *b = args->bounds;
+    int k = km->k, a = km->assign[i];
+    float *lowers = b->lowers + (size_t)i * k;
+    if (a < 0)
+        return bound_scan(args, x, i);
+
+    double u = b->upper[i] + b->drift[a];
+    double l = b->lower[i] - b->maxdrift;
+    b->upper[i] = u;
+    b->lower[i] = l;
+    if (fmax(l, b->s[a] - u) > bound_far(b, u))
+        return a;
+
+    // Tighten the upper bound and try again
+    float da = kmeans_dist(x, km->cap, km->D, km->centroid + (size_t)a * km->D);
+    args->distances++;
+    u = sqrt(da) * (1.0 + b->slack);
+    lowers[a] = round_down(sqrt(da) * (1.0 - b->slack) + b->total[a]);
+    b->upper[i] = u;
+    double far = bound_far(b, u);
+    if (fmax(l, b->s[a] - u) > far)
+        return a;
+
+    // The centroids still in the running, all at once if there are many
+    const double *cc = b->cc + (size_t)a * k;
+    int *left = args->left, nleft = 0;
+    for (int c = 0; c < k; c++)
+    {
+        if (c != a && cc[c] <= u + far && lowers[c] - b->total[c] <= far)
+            left[nleft++] = c;
+    }
+    if (nleft > k / 8)
+        return bound_scan(args, x, i);
+
+    for (int j = 0; j < nleft; j++)
+    {
+        int c = left[j];
+        if (cc[c] > u + far || lowers[c] - b->total[c] > far)
+            continue;
+        float dc = kmeans_dist(x, km->cap, km->D, km->centroid + (size_t)c * km->D);
+        args->distances++;
+        lowers[c] = round_down(sqrt(dc) * (1.0 - b->slack) + b->total[c]);
+        if (dc < da || (dc == da && c > a)) // The search takes the last of equals
+        {
+            a = c;
+            da = dc;
+            u = sqrt(dc) * (1.0 + b->slack);
+            far = bound_far(b, u);
+            cc = b->cc + (size_t)a * k;
+        }
+    }
+    b->upper[i] = u;
+
+    // The single lower bound again, over the centroids other than the nearest
+    l = INFINITY;
+    for (int c = 0; c < k; c++)
+    {
+        if (c != a)
+            l = fmin(l, fmax(lowers[c] - b->total[c], cc[c] - u));
+    }
+    b->lower[i] = l;
+    return a;
+}
+
+/*
+ * Hamerly and Elkan, after an update: the distances between the
+ * centroids this worker computed, c0 to c1.
+ */
+static void bound_centroids(struct threadArgs *args, int c0, int c1)
+{
+    struct kmeans *km = args->km;
+    struct bounds *b = args->bounds;
+    int k = km->k, D = km->D;
+
+    for (int a = c0; a < c1; a++)
+    {
+        double s = INFINITY;
+        for (int d = 0; d < D; d++)
+            b->ct[(size_t)d * k + a] = km->centroid[(size_t)a * D + d];
+        for (int c = 0; c < k; c++)
+        {
+            if (c == a)
+                continue;
+            double dist = 0.0;
+            for (int d = 0; d < D; d++)
+            {
+                double dx = (double)km->centroid[(size_t)a * D + d] - km->centroid[(size_t)c * D + d];
+                dist += dx * dx;
+            }
+            dist = sqrt(dist) * (1.0 - 1e-12);
+            if (b->cc != NULL)
+                b->cc[(size_t)a * k + c] = dist;
+            if (dist < s)
+                s = dist;
+        }
+        b->s[a] = s;
+    }
+}
+
+// Allocate the bounds of km->algorithm, falling back to the next simpler one if memory is short
+static struct bounds *bounds_alloc(struct kmeans *km)
+{
+    struct bounds *b;
+    size_t N = km->N, k = km->k;
+
+    if (km->algorithm == KMEANS_ELKAN && N * k > KMEANS_ELKAN_MAX)
+        km->algorithm = KMEANS_HAMERLY;
+    if (km->algorithm == KMEANS_LLOYD || (b = calloc(1, sizeof(*b))) == NULL)
+    {
+        km->algorithm = KMEANS_LLOYD;
+        return NULL;
+    }
+    b->slack = (km->D + 4) * FLT_EPSILON;
+    b->far_u = (1.0 + b->slack) / (1.0 - b->slack) * (1.0 + 1e-12);
+    b->far_0 = 1e-18 / (1.0 - b->slack);
+    b->upper = malloc(N * sizeof(double));
+    b->drift = malloc(k * sizeof(double));
+    b->s = malloc(k * sizeof(double));
+    b->ct = malloc(k * km->D * sizeof(float));
+    if (km->algorithm == KMEANS_ELKAN)
+    {
+        b->lowers = malloc(N * k * sizeof(float));
+        b->cc = malloc(k * k * sizeof(double));
+        b->total = calloc(k, sizeof(double));
+        if (b->lowers == NULL || b->cc == NULL || b->total == NULL)
+        {
+            free(b->lowers);
+            free(b->cc);
+            free(b->total);
+            b->lowers = NULL;
+            b->cc = NULL;
+            b->total = NULL;
+            km->algorithm = KMEANS_HAMERLY;
+        }
+    }
+    b->lower = malloc(N * sizeof(double));
+    if (b->upper == NULL || b->lower == NULL || b->drift == NULL || b->s == NULL || b->ct == NULL)
+    {
+        bounds_free(b);
+        km->algorithm = KMEANS_LLOYD;
+        return NULL;
+    }
+    for (size_t c = 0; c < k; c++)
+    {
+        for (int d = 0; d < km->D; d++)
+            b->ct[d * k + c] = km->centroid[c * km->D + d];
+    }
+    return b;
+}
+
+static void bounds_free(struct bounds *b)
+{
+    if (b == NULL)
+        return;
+    free(b->upper);
+    free(b->lower);
+    free(b->lowers);
+    free(b->drift);
+    free(b->cc);
+    free(b->s);
+    free(b->total);
+    free(b->ct);
+    free(b);
+}
+
+/*
+ * Kmeans algorithm. The workers live for the whole clustering: in each
+ * iteration they assign their points and sum them per cluster in the
+ * same pass, then each reduces a share of the clusters into the new
+ * centroids. Two barriers per iteration, no serial pass over the points.
+ * Hamerly and Elkan (km->algorithm) skip the distances that bounds show
+ * cannot change a point's cluster, for a third barrier per iteration.
+ * It stops once no point changes cluster, or with km->tol once at most
+ * tol * N do or the squared moves of the centroids add up to at most tol
+ * times the variance of the data per dimension, or after km->max_iter
+ * iterations. With km->traced, km->trace gets each iteration.
+ * Returns -1 if memory is short or the workers cannot all be started,
+ * the points keeping their clusters.
+ */
+int kmeans_cluster(struct kmeans *km)
+{
+    pthread_t children[KMEANS_THREADS];
+    struct threadArgs args[KMEANS_THREADS];
+    pthread_barrier_t barrier;
+    struct gate gate = {PTHREAD_MUTEX_INITIALIZER, false};
+    struct bounds *bounds = bounds_alloc(km);
+
+    // Each worker's sums and counts start on their own cache line
+    size_t sums_size = ((size_t)km->k * km->D * sizeof(double) + KMEANS_ALIGN - 1) / KMEANS_ALIGN * KMEANS_ALIGN;
+    size_t stride = sums_size + (km->k * sizeof(int) + KMEANS_ALIGN - 1) / KMEANS_ALIGN * KMEANS_ALIGN;
+    char *sums = aligned_alloc(KMEANS_ALIGN, KMEANS_THREADS * stride);
+    if (sums == NULL)
+    {
+        bounds_free(bounds);
+        return -1;
+    }
+    free(km->trace);
+    km->trace = NULL;
+    km->trace_len = 0;
+
+    pthread_barrier_init(&barrier, NULL, KMEANS_THREADS);
+    for (int i = 0; i < KMEANS_THREADS; i++)
+    {
+        args[i].km = km;
+        args[i].i = i;
+        args[i].changed = 0;
+        args[i].shift = 0.0;
+        args[i].inertia = 0.0;
+        args[i].barrier = &barrier;
+        args[i].all = args;
+        args[i].sums = (double *)(sums + i * stride);
+        args[i].counts = (int *)(sums + i * stride + sums_size);
+        args[i].bounds = bounds;
+        args[i].distances = 0;
+        args[i].gate = &gate;
+    }
+    int started = start_workers(km, children, args, kmeans_worker);
+
+    // Wait for all threads to complete
+    km->distances = 0;
+    for (int j = 0; j < started; j++)
+    {
+        pthread_join(children[j], NULL);
+        km->distances += args[j].distances;
+    }
+    pthread_barrier_destroy(&barrier);
+    free(sums);
+    bounds_free(bounds);
+    return gate.abort ? -1 : 0;
+}
+
+/*
+ * Empty clusters: own points farthest from their centroids, farthest
+ * first and the first point of equals first, up to n of them. Points
+ * on their centroid are no better as a centroid and are left alone.
+ */
+static void farthest_points(struct threadArgs *args, int start, int end, int n)
+{
+    struct kmeans *km = args->km;
+    int nfar = 0;
+    for (int i = start; i < end; i++)
+    {
+        int a = km->assign[i];
+        if (a < 0)
+            continue;
+        float dist = kmeans_dist(km->coords + i, km->cap, km->D, km->centroid + (size_t)a * km->D);
+        if (!(dist > 0.0f) || (nfar == n && dist <= args->far_dist[n - 1]))
+            continue;
+        int j = (nfar < n) ? nfar++ : n - 1;
+        for (; j > 0 && args->far_dist[j - 1] < dist; j--)
+        {
+            args->far[j] = args->far[j - 1];
+            args->far_dist[j] = args->far_dist[j - 1];
+        }
+        args->far[j] = i;
+        args->far_dist[j] = dist;
+    }
+    args->nfar = nfar;
+}
+
+/*
+ * Worker 0: move the farthest points of all workers, the first worker's
+ * of equals first, into the n empty clusters, one each, taking them out
+ * of the sums of their old clusters. Their centroids become those points
+ * in the update instead of NaN. Clusters left without one keep their
+ * centroid. The moved points' Hamerly bounds are reset: the distance to
+ * their centroid is 0 after the update, that to any other is unknown.
+ */
+static void relocate_points(struct threadArgs *args, const int *empty, int n)
+{
+    struct threadArgs *all = args->all;
+    struct kmeans *km = args->km;
+    struct bounds *b = args->bounds;
+    int head[KMEANS_THREADS] = {0};
+    int D = km->D;
+
+    for (int e = 0; e < n; e++)
+    {
+        int t = -1;
+        for (int w = 0; w < KMEANS_THREADS; w++)
+        {
+            if (head[w] < all[w].nfar && (t == -1 || all[w].far_dist[head[w]] > all[t].far_dist[head[t]]))
+                t = w;
+        }
+        if (t == -1)
+            return;
+        // The point is one of worker t's, so are the sums it is in
+        int i = all[t].far[head[t]++], a = km->assign[i], c = empty[e];
+        for (int d = 0; d < D; d++)
+        {
+            float x = km->coords[(size_t)d * km->cap + i];
+            all[t].sums[(size_t)a * D + d] -= x;
+            all[t].sums[(size_t)c * D + d] += x;
+        }
+        all[t].counts[a]--;
+        all[t].counts[c]++;
+        km->assign[i] = c;
+        args->changed++;
+        if (b != NULL)
+        {
+            b->upper[i] = 0.0;
+            b->lower[i] = 0.0;
+        }
+    }
+}
+
+/*
+ * --tol: the variance of the data summed over the dimensions, from the
+ * sums of the points of all workers. Each worker gets the same.
+ */
+static double data_variance(struct threadArgs *args, int start, int end)
+{
+    struct threadArgs *all = args->all;
+    struct kmeans *km = args->km;
+    double sq = 0.0, var = 0.0;
+
+    for (int d = 0; d < km->D; d++)
+    {
+        const float *x = km->coords + (size_t)d * km->cap;
+        double sum = 0.0;
+        for (int i = start; i < end; i++)
+        {
+            sum += x[i];
+            sq += (double)x[i] * x[i];
+        }
+        args->sums[d] = sum;
+    }
+    args->inertia = sq;
+    pthread_barrier_wait(args->barrier);
+
+    for (int t = 0; t < KMEANS_THREADS; t++)
+        var += all[t].inertia;
+    var /= km->N;
+    for (int d = 0; d < km->D; d++)
+    {
+        double mean = 0.0;
+        for (int t = 0; t < KMEANS_THREADS; t++)
+            mean += all[t].sums[d];
+        mean /= km->N;
+        var -= mean * mean;
+    }
+    // Nobody overwrites the sums before all are done
+    pthread_barrier_wait(args->barrier);
+    return var;
+}
+
+// Traced: add an iteration to km->trace, which only worker 0 touches
+static void trace_add(struct kmeans *km, const struct kmeans_iter *it)
+{
+    if (km->trace_len == 0 || (km->trace_len >= 16 && (km->trace_len & (km->trace_len - 1)) == 0))
+    {
+        struct kmeans_iter *trace = realloc(km->trace, (km->trace_len ? 2 * km->trace_len : 16) * sizeof(*trace));
+        if (trace == NULL)
+            return;
+        km->trace = trace;
+    }
+    km->trace[km->trace_len++] = *it;
+}
+
+static void *kmeans_worker(void *params)
+{
+    struct threadArgs *args = (struct threadArgs *)params;
+    struct threadArgs *all = args->all;
+    struct kmeans *km = args->km;
+    struct bounds *bounds = args->bounds;
+    double *sums = args->sums;
+    int *counts = args->counts;
+    int D = km->D;
+    size_t cap = km->cap;
+    kmeans_nearest_fn nearest = kmeans_nearest(D);
+    int near[KMEANS_CHUNK];
+    float dist[km->k], far_dist[km->k];
+    int left[km->k], far[km->k], empty[km->k];
+    int start, end, iter = 0;
+    bool more;
+
+    if (!gate_pass(args->gate))
+        return NULL;
+    worker_rows(km, args->i, &start, &end);
+    args->dist = dist;
+    args->left = left;
+    args->far = far;
+    args->far_dist = far_dist;
+
+    // --tol: how far all centroids may move together, squared, and still be done
+    double still = (km->tol > 0.0) ? km->tol * data_variance(args, start, end) / D : 0.0;
+
+    // The centroids this worker computes
+    int c0 = (long)km->k * args->i / KMEANS_THREADS;
+    int c1 = (long)km->k * (args->i + 1) / KMEANS_THREADS;
+
+    do
+    {
+        struct kmeans_iter it = {0};
+        struct timespec t0, t1;
+        iter++; // Keep track of number of iterations
+        if (args->i == 0 && km->traced)
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        // Assign own points and sum them up per cluster
+        memset(sums, 0, (size_t)km->k * D * sizeof(double));
+        memset(counts, 0, km->k * sizeof(int));
+        int changed = 0;
+        double inertia = 0.0;
+        for (int i0 = start; i0 < end; i0 += KMEANS_CHUNK)
+        {
+            int n = (end - i0 < KMEANS_CHUNK) ? end - i0 : KMEANS_CHUNK;
+            if (km->algorithm == KMEANS_HAMERLY)
+            {
+                for (int j = 0; j < n; j++)
+                    near[j] = hamerly_point(args, km->coords + i0 + j, i0 + j);
+            }
+            else if (km->algorithm == KMEANS_ELKAN)
+            {
+                for (int j = 0; j < n; j++)
+                    near[j] = elkan_point(args, km->coords + i0 + j, i0 + j);
+            }
+            else
+            {
+                nearest(km->coords + i0, cap, n, D, km->centroid, km->k, near);
+                args->distances += (long long)n * km->k;
+            }
+            changed += assign_points(km->coords + i0, cap, n, D, near, km->assign + i0, sums, counts);
+            for (int j = 0; j < n && km->traced; j++)
+            {
+                if (near[j] >= 0)
+                    inertia += kmeans_dist(km->coords + i0 + j, cap, D, km->centroid + (size_t)near[j] * D);
+            }
+        }
+        args->changed = changed;
+        args->inertia = inertia;
+        pthread_barrier_wait(args->barrier);
+
+        // Empty clusters get the points farthest from their centroids, two more barriers
+        int nempty = 0;
+        for (int c = 0; c < km->k; c++)
+        {
+            int count = 0;
+            for (int t = 0; t < KMEANS_THREADS; t++)
+                count += all[t].counts[c];
+            if (count == 0)
+                empty[nempty++] = c;
+        }
+        if (nempty > 0)
+        {
+            farthest_points(args, start, end, nempty);
+            pthread_barrier_wait(args->barrier);
+            if (args->i == 0)
+                relocate_points(args, empty, nempty);
+            pthread_barrier_wait(args->barrier);
+        }
+
+        // Reduce own share of the clusters over all workers
+        double shift = 0.0;
+        for (int c = c0; c < c1; c++)
+        {
+            int count = 0;
+            double drift = 0.0;
+            for (int t = 0; t < KMEANS_THREADS; t++)
+                count += all[t].counts[c];
+            for (int d = 0; d < D && count > 0; d++) // Still empty: it stays where it is
+            {
+                double sum = 0.0;
+                for (int t = 0; t < KMEANS_THREADS; t++)
+                    sum += all[t].sums[(size_t)c * D + d];
+                float old = km->centroid[(size_t)c * D + d];
+                km->centroid[(size_t)c * D + d] = sum / count;
+                drift += ((double)km->centroid[(size_t)c * D + d] - old) *
+                         ((double)km->centroid[(size_t)c * D + d] - old);
+            }
+            shift += drift;
+            if (bounds != NULL)
+                bounds->drift[c] = sqrt(drift) * (1.0 + 1e-12);
+            if (bounds != NULL && bounds->total != NULL)
+                bounds->total[c] += bounds->drift[c];
+        }
+        args->shift = shift;
+        for (int t = 0; t < KMEANS_THREADS; t++)
+        {
+            it.changed += all[t].changed;
+            it.inertia += all[t].inertia;
+        }
+        // Nobody assigns with the new centroids or overwrites the sums and counts before all are done
+        pthread_barrier_wait(args->barrier);
+
+        // The shifts are only written again after the first barrier of the next iteration
+        for (int t = 0; t < KMEANS_THREADS; t++)
+            it.shift += all[t].shift;
+        more = it.changed > 0 && (km->max_iter == 0 || iter < km->max_iter) &&
+               (km->tol == 0.0 || (it.changed > km->tol * km->N && !(it.shift <= still)));
+        if (args->i == 0 && km->traced)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            it.seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+            trace_add(km, &it);
+        }
+
+        if (bounds != NULL && more)
+        {
+            // The bounds need the distances between the new centroids, all of them before going on
+            bound_centroids(args, c0, c1);
+            if (args->i == 0)
+            {
+                double maxdrift = 0.0;
+                for (int c = 0; c < km->k; c++)
+                {
+                    if (bounds->drift[c] > maxdrift)
+                        maxdrift = bounds->drift[c];
+                }
+                bounds->maxdrift = maxdrift;
+            }
+            pthread_barrier_wait(args->barrier);
+        }
+    } while (more);
+
+    if (args->i == 0)
+    {
+        km->iterations = iter;
+    }
+    return NULL;
+}
+
+/*
+ * Mini-batch input of kmeans_stream(): the points of a text or dataset
+ * file, a batch at a time, from fd or, if fd is -1, from the `len` bytes
+ * at mem. Only one batch and about KMEANS_STREAM_BUF bytes of text are in
+ * memory at once. The checksum of a dataset is not verified, it would
+ * take a pass over all of it.
+ */
+struct stream
+{
+    int fd;
+    const char *mem;
+    size_t len;
+    bool dataset;   // A dataset file, else text
+    uint64_t N;     // Dataset: its points
+    uint64_t next;  // Dataset: the next point to read
+    int D;
+    char *buf;      // Text from fd: buf[pos, fill) is not parsed yet
+    size_t size, pos, fill;
+    bool eof, failed;
+};
+
+/*
+ * Mini-batch kmeans, shared by the workers of kmeans_stream(). Each
+ * centroid is the mean of all the points assigned to it so far, which is
+ * the per-centroid learning rate of Sculley (2010), a batch at a time.
+ */
+struct streaming
+{
+    struct stream in;
+    FILE *out;     // Where the last pass writes the points and their clusters
+    int assignments; // Or only their clusters
+    int passes;    // Passes updating the centroids, before the last one
+    bool end;      // No points left in this pass
+    int error;     // Why the last pass could not write the points, else 0
+    double *sums;  // Per cluster: the sum of the points assigned to it, k * D
+    long long *counts; // Per cluster: how many there were
+};
+
+// The next line of text [*line, *next), reading more as needed. Returns false at the end.
+static bool stream_line(struct stream *s, const char **line, const char **next)
+{
+    if (s->fd == -1)
+    {
+        if (s->pos >= s->len)
+            return false;
+        *line = s->mem + s->pos;
+        *next = next_line(*line, s->mem + s->len);
+        s->pos = *next - s->mem;
+        return true;
+    }
+    while (!s->eof && memchr(s->buf + s->pos, '\n', s->fill - s->pos) == NULL)
+    {
+        // Keep the partial line, in a larger buffer if it fills this one
+        memmove(s->buf, s->buf + s->pos, s->fill - s->pos);
+        s->fill -= s->pos;
+        s->pos = 0;
+        if (s->fill == s->size)
+        {
+            char *buf = realloc(s->buf, 2 * s->size);
+            if (buf == NULL)
+            {
+                s->failed = s->eof = true;
+                break;
+            }
+            s->buf = buf;
+            s->size *= 2;
+        }
+        ssize_t n = read(s->fd, s->buf + s->fill, s->size - s->fill);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            s->eof = true;
+        if (n == -1)
+            s->failed = true;
+        else
+            s->fill += n;
+    }
+    if (s->pos >= s->fill)
+        return false;
+    *line = s->buf + s->pos;
+    *next = next_line(*line, s->buf + s->fill);
+    s->pos = *next - s->buf;
+    return true;
+}
+
+static void stream_rewind(struct stream *s)
+{
+    s->next = 0;
+    s->pos = 0;
+    s->fill = 0;
+    s->eof = false;
+    if (s->fd != -1 && !s->dataset && lseek(s->fd, 0, SEEK_SET) == -1)
+        s->failed = true;
+}
+
+/*
+ * Open the input and find the dimensions of its points. Returns -1, with
+ * errno EINVAL if it is not a dataset or text with points.
+ */
+static int stream_open(struct stream *s, int fd, const char *mem, size_t len)
+{
+    unsigned char hdr[KMEANS_FILE_HDR] = {0};
+    const char *line, *next;
+    struct stat st;
+
+    memset(s, 0, sizeof(struct stream));
+    s->fd = fd;
+    s->mem = mem;
+    s->len = len;
+    if (fd != -1)
+    {
+        if (fstat(fd, &st) == -1)
+            return -1;
+        s->len = st.st_size;
+        if (pread(fd, hdr, sizeof(hdr), 0) == -1)
+            return -1;
+    }
+    else
+    {
+        memcpy(hdr, mem, (len < sizeof(hdr)) ? len : sizeof(hdr));
+    }
+
+    if (s->len >= 4 && memcmp(hdr, KMEANS_FILE_MAGIC, 4) == 0)
+    {
+        s->dataset = true;
+        s->N = get_le(hdr + 8, 8);
+        s->D = get_le(hdr + 16, 4);
+        if (s->len < KMEANS_FILE_HDR || get_le(hdr + 4, 4) != KMEANS_FILE_VERSION || s->N < 1 || s->D < 1 ||
+            s->D > MAX_DIMS || (s->len - KMEANS_FILE_HDR) / sizeof(float) / s->D < s->N)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        return 0;
+    }
+
+    if (fd != -1 && (s->buf = malloc(s->size = KMEANS_STREAM_BUF)) == NULL)
+        return -1;
+    // The first point tells the dimensions, two if it is not a point at all
+    do
+    {
+        if (!stream_line(s, &line, &next))
+        {
+            errno = s->failed ? errno : EINVAL;
+            return -1;
+        }
+    } while (isspace((unsigned char)line[0]));
+    float first[MAX_DIMS];
+    s->D = parse_point(line, next, first, MAX_DIMS, 1, MAX_DIMS);
+    if (s->D == 0)
+        s->D = 2;
+    stream_rewind(s);
+    return s->failed ? -1 : 0;
+}
+
+// Read `len` bytes at `off` of the input
+static int stream_pread(struct stream *s, void *to, size_t len, uint64_t off)
+{
+    if (s->fd == -1)
+    {
+        memcpy(to, s->mem + off, len);
+        return 0;
+    }
+    for (size_t done = 0; done < len;)
+    {
+        ssize_t n = pread(s->fd, (char *)to + done, len - done, off + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Read the next km->cap points, at most, into km. Returns how many, -1 if reading fails.
+static int stream_read(struct stream *s, struct kmeans *km)
+{
+    const char *line, *next;
+    int n = 0;
+
+    if (s->dataset)
+    {
+        uint64_t left = s->N - s->next;
+        n = left < (uint64_t)km->cap ? (int)left : km->cap;
+        for (int d = 0; d < km->D && n > 0; d++)
+        {
+            float *x = km->coords + (size_t)d * km->cap;
+            if (stream_pread(s, x, n * sizeof(float), KMEANS_FILE_HDR + (d * s->N + s->next) * sizeof(float)) == -1)
+                return -1;
+            for (int j = 0; j < n && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__; j++)
+            {
+                uint32_t bits = get_le((const unsigned char *)&x[j], sizeof(float));
+                memcpy(&x[j], &bits, sizeof(float));
+            }
+        }
+        s->next += n;
+    }
+    else
+    {
+        while (n < km->cap && stream_line(s, &line, &next))
+        {
+            if (isspace((unsigned char)line[0]))
+                continue;
+            parse_point(line, next, km->coords + n, km->D, km->cap, km->D);
+            n++;
+        }
+        if (s->failed)
+            return -1;
+    }
+    for (int j = 0; j < n; j++)
+        km->assign[j] = -1;
+    km->N = n;
+    return n;
+}
+
+/*
+ * Worker of kmeans_stream(). Worker 0 reads each batch, then all assign
+ * their share of it, then worker 0 adds it to the centroids or, in the
+ * last pass, writes it out.
+ */
+static void *stream_worker(void *params)
+{
+    struct threadArgs *args = (struct threadArgs *)params;
+    struct threadArgs *all = args->all;
+    struct streaming *st = args->streaming;
+    struct kmeans *km = args->km;
+    int D = km->D;
+    kmeans_nearest_fn nearest = kmeans_nearest(D);
+    int near[KMEANS_CHUNK];
+    int start, end;
+
+    if (!gate_pass(args->gate))
+        return NULL;
+    for (int pass = 0; pass <= st->passes; pass++)
+    {
+        if (args->i == 0)
+            stream_rewind(&st->in);
+        for (;;)
+        {
+            if (args->i == 0)
+                st->end = (stream_read(&st->in, km) <= 0);
+            pthread_barrier_wait(args->barrier);
+            if (st->end)
+                break;
+
+            worker_rows(km, args->i, &start, &end);
+            memset(args->sums, 0, (size_t)km->k * D * sizeof(double));
+            memset(args->counts, 0, km->k * sizeof(int));
+            for (int i0 = start; i0 < end; i0 += KMEANS_CHUNK)
+            {
+                int n = (end - i0 < KMEANS_CHUNK) ? end - i0 : KMEANS_CHUNK;
+                nearest(km->coords + i0, km->cap, n, D, km->centroid, km->k, near);
+                args->distances += (long long)n * km->k;
+                assign_points(km->coords + i0, km->cap, n, D, near, km->assign + i0, args->sums, args->counts);
+            }
+            pthread_barrier_wait(args->barrier);
+
+            if (args->i == 0 && pass == st->passes)
+            {
+                if (kmeans_write(km, st->out, st->assignments) == -1 && st->error == 0)
+                    st->error = errno ? errno : EIO;
+            }
+            else if (args->i == 0)
+            {
+                km->iterations++;
+                for (int c = 0; c < km->k; c++)
+                {
+                    long long count = 0;
+                    for (int t = 0; t < KMEANS_THREADS; t++)
+                        count += all[t].counts[c];
+                    if (count == 0)
+                        continue; // Nothing new, it stays where it is
+                    st->counts[c] += count;
+                    for (int d = 0; d < D; d++)
+                    {
+                        for (int t = 0; t < KMEANS_THREADS; t++)
+                            st->sums[(size_t)c * D + d] += all[t].sums[(size_t)c * D + d];
+                        km->centroid[(size_t)c * D + d] = st->sums[(size_t)c * D + d] / st->counts[c];
+                    }
+                }
+            }
+        }
+        // Worker 0 must not start the next pass before all saw the end of this one
+        pthread_barrier_wait(args->barrier);
+    }
+    return NULL;
+}
+
+// kmeans_stream() on the workers, once the centroids are set
+static int stream_run(struct kmeans *km, struct streaming *st)
+{
+    pthread_t children[KMEANS_THREADS];
+    struct threadArgs args[KMEANS_THREADS];
+    pthread_barrier_t barrier;
+    struct gate gate = {PTHREAD_MUTEX_INITIALIZER, false};
+
+    // Each worker's sums and counts start on their own cache line, as in kmeans_cluster()
+    size_t sums_size = ((size_t)km->k * km->D * sizeof(double) + KMEANS_ALIGN - 1) / KMEANS_ALIGN * KMEANS_ALIGN;
+    size_t stride = sums_size + (km->k * sizeof(int) + KMEANS_ALIGN - 1) / KMEANS_ALIGN * KMEANS_ALIGN;
+    char *sums = aligned_alloc(KMEANS_ALIGN, KMEANS_THREADS * stride);
+    st->sums = calloc((size_t)km->k * km->D, sizeof(double));
+    st->counts = calloc(km->k, sizeof(long long));
+    if (sums == NULL || st->sums == NULL || st->counts == NULL)
+    {
+        free(sums);
+        return -1;
+    }
+
+    pthread_barrier_init(&barrier, NULL, KMEANS_THREADS);
+    for (int i = 0; i < KMEANS_THREADS; i++)
+    {
+        args[i].km = km;
+        args[i].i = i;
+        args[i].barrier = &barrier;
+        args[i].all = args;
+        args[i].sums = (double *)(sums + i * stride);
+        args[i].counts = (int *)(sums + i * stride + sums_size);
+        args[i].distances = 0;
+        args[i].streaming = st;
+        args[i].gate = &gate;
+    }
+    int started = start_workers(km, children, args, stream_worker);
+    km->distances = 0;
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(children[i], NULL);
+        km->distances += args[i].distances;
+    }
+    pthread_barrier_destroy(&barrier);
+    free(sums);
+    if (st->error != 0)
+        errno = st->error;
+    return (gate.abort || st->in.failed || st->error != 0) ? -1 : 0;
+}
+
+/*
+ * Mini-batch kmeans over input that need not fit in memory: a text or
+ * dataset file read from fd or, if fd is -1, the `len` bytes at buf.
+ * The centroids are k random points of the first batch, or those of
+ * kmeans_seed() on it (opt->init). opt->passes passes over the input in
+ * batches of opt->batch points update them, then a last pass writes the
+ * points with their clusters to `out` as kmeans_write() does (only the
+ * clusters with opt->assignments). km holds a
+ * batch at a time; km->iterations is the number of batches that updated
+ * the centroids. Returns -1 if the input cannot be read, has no points,
+ * the CPU list opt->cpus is bad (errno EINVAL), memory is short or the
+ * points cannot be written to `out`;
+ * kmeans_free(km) in any case.
+ */
+int kmeans_stream(struct kmeans *km, int fd, const char *buf, size_t len, const struct kmeans_options *opt, FILE *out)
+{
+    struct streaming st = {0};
+    int rc = -1;
+
+    memset(km, 0, sizeof(struct kmeans));
+    km->k = opt->k;
+    st.out = out;
+    st.passes = opt->passes;
+    st.assignments = opt->assignments;
+    if (opt->cpus != NULL && (km->ncpus = cpulist_parse(opt->cpus, &km->cpus)) == -1)
+    {
+        km->ncpus = 0;
+        km->cpus = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    if (stream_open(&st.in, fd, buf, len) != -1)
+    {
+        km->D = st.in.D;
+        if (grow_points(km, (opt->batch > 0) ? opt->batch : 1) != -1 && stream_read(&st.in, km) > 0 &&
+            init_centroids(km, km->k) != -1)
+        {
+            kmeans_seed(km, opt->init); // The random centroids stay if memory is short
+            rc = stream_run(km, &st);
+        }
+    }
+    free(st.in.buf);
+    free(st.sums);
+    free(st.counts);
+    return rc;
+}
+
+// Most bytes of one point written by format_points(), with the NUL of the last number
+static size_t point_bytes(struct kmeans *km, int assignments)
+{
+    return (assignments ? 0 : (size_t)km->D * (FMT_FIXED2_MAX + 1)) + FMT_INT_MAX + 1;
+}
+
+// Worker of kmeans_write(): format own block of points, as fprintf() "%.2f " and "%d\n" would
+static void *format_points(void *params)
+{
+    struct writeArgs *args = (struct writeArgs *)params;
+    struct kmeans *km = args->km;
+    char *p = args->buf;
+    for (int i = args->from; i < args->to; i++)
+    {
+        for (int d = 0; d < km->D && !args->assignments; d++)
+        {
+            p += fmt_fixed2(p, km->coords[(size_t)d * km->cap + i]);
+            *p++ = ' ';
+        }
+        p += fmt_int(p, km->assign[i]);
+        *p++ = '\n';
+    }
+    args->len = p - args->buf;
+    return NULL;
+}
+
+// pwritev() all of the n buffers at *off, going on after short writes
+static int pwritev_all(int fd, struct iovec *iov, int n, off_t *off)
+{
+    for (;;)
+    {
+        for (; n > 0 && iov->iov_len == 0; iov++)
+            n--;
+        if (n == 0)
+            return 0;
+        ssize_t w = pwritev(fd, iov, n, *off);
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        *off += w;
+        for (; n > 0 && (size_t)w >= iov->iov_len; iov++, n--)
+            w -= iov->iov_len;
+        if (n > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+}
+
+/*
+ * The results a round at a time: each worker formats a block of points
+ * into its own buffer, then the blocks are written in order, with one
+ * pwritev() if fd is not -1, else to fp.
+ */
+static int write_results(struct kmeans *km, FILE *fp, int fd, int assignments)
+{
+    pthread_t children[KMEANS_THREADS];
+    struct writeArgs args[KMEANS_THREADS];
+    struct iovec iov[KMEANS_THREADS];
+    bool started[KMEANS_THREADS];
+    pthread_attr_t attr;
+    size_t bytes = point_bytes(km, assignments);
+    int per = (KMEANS_WRITE_BUF / bytes > 0) ? KMEANS_WRITE_BUF / bytes : 1;
+    off_t off = 0;
+    int rc = 0;
+
+    if (km->N == 0)
+        return 0;
+    if (per > (km->N + KMEANS_THREADS - 1) / KMEANS_THREADS)
+        per = (km->N + KMEANS_THREADS - 1) / KMEANS_THREADS;
+    char *bufs = malloc(KMEANS_THREADS * per * bytes);
+    if (bufs == NULL)
+        return -1;
+
+    for (long r0 = 0; r0 < km->N && rc == 0; r0 += (long)per * KMEANS_THREADS)
+    {
+        for (int t = 0; t < KMEANS_THREADS; t++)
+        {
+            args[t].km = km;
+            args[t].from = (r0 + (long)t * per < km->N) ? r0 + (long)t * per : km->N;
+            args[t].to = (r0 + (long)(t + 1) * per < km->N) ? r0 + (long)(t + 1) * per : km->N;
+            args[t].assignments = assignments;
+            args[t].buf = bufs + t * per * bytes;
+            args[t].len = 0;
+            started[t] = false;
+            if (t == 0 || args[t].from == args[t].to)
+                continue;
+            pthread_attr_init(&attr);
+            if (km->cpus != NULL)
+                pin_attr(&attr, km->cpus[t % km->ncpus]);
+            started[t] = (pthread_create(&children[t], &attr, format_points, &args[t]) == 0);
+            pthread_attr_destroy(&attr);
+            if (!started[t])
+                format_points(&args[t]); // No thread for this block, format it here
+        }
+        format_points(&args[0]);
+        for (int t = 1; t < KMEANS_THREADS; t++)
+        {
+            if (started[t])
+                pthread_join(children[t], NULL);
+        }
+
+        for (int t = 0; t < KMEANS_THREADS; t++)
+        {
+            iov[t].iov_base = args[t].buf;
+            iov[t].iov_len = args[t].len;
+            if (fd == -1 && fwrite(args[t].buf, 1, args[t].len, fp) != args[t].len)
+                rc = -1;
+        }
+        if (fd != -1)
+            rc = pwritev_all(fd, iov, KMEANS_THREADS, &off);
+    }
+    free(bufs);
+    return rc;
+}
+
+/*
+ * Write the points and their clusters to fp, one point per line, or with
+ * `assignments` only the clusters. The workers format the lines. Returns
+ * -1 if writing fails or memory is short.
+ */
+int kmeans_write(struct kmeans *km, FILE *fp, int assignments)
+{
+    return (write_results(km, fp, -1, assignments) == -1 || ferror(fp)) ? -1 : 0;
+}
+
+/*
+ * kmeans_write() to a new file at `path`, with pwritev(), and close it.
+ * Returns -1 with errno set if it cannot be written.
+ */
+int kmeans_write_file(struct kmeans *km, const char *path, int assignments)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1)
+        return -1;
+    int rc = write_results(km, NULL, fd, assignments);
+    if (close(fd) == -1)
+        rc = -1;
+    return rc;
+}
+
+// A number in JSON, which has no NaN or infinity
+static void json_number(FILE *fp, const char *name, double v)
+{
+    if (isfinite(v))
+        fprintf(fp, "\"%s\": %.9g", name, v);
+    else
+        fprintf(fp, "\"%s\": null", name);
+}
+
+// The iterations traced by kmeans_cluster(), as JSON
+void kmeans_write_trace(struct kmeans *km, FILE *fp)
+{
+    static const char *algorithms[] = {"lloyd", "hamerly", "elkan"};
+    fprintf(fp, "{\"algorithm\": \"%s\", \"N\": %d, \"D\": %d, \"k\": %d, ", algorithms[km->algorithm], km->N,
+            km->D, km->k);
+    json_number(fp, "tol", km->tol);
+    fprintf(fp, ", \"max_iter\": %d, \"iterations\": [", km->max_iter);
+    for (int i = 0; i < km->trace_len; i++)
+    {
+        const struct kmeans_iter *it = &km->trace[i];
+        fprintf(fp, "%s\n  {\"iteration\": %d, \"changed\": %d, ", (i > 0) ? "," : "", i + 1, it->changed);
+        json_number(fp, "changed_fraction", (double)it->changed / km->N);
+        fprintf(fp, ", ");
+        json_number(fp, "shift", it->shift);
+        fprintf(fp, ", ");
+        json_number(fp, "inertia", it->inertia);
+        fprintf(fp, ", ");
+        json_number(fp, "seconds", it->seconds);
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "\n]}\n");
+}
+
+void kmeans_free(struct kmeans *km)
+{
+    free_points(km);
+    free(km->centroid);
+    free(km->cpus);
+    free(km->trace);
+    km->centroid = NULL;
+    km->cpus = NULL;
+    km->trace = NULL;
+}
@@ -0,0 +1,297 @@
+/*
+ * Vectorized nearest-centroid search of kmeans (see kmeans_simd.h).
+ *
+ * The points are stored one dimension after the other, so a register
+ * holds coordinate d of 8 (AVX2) or 16 (AVX-512) points, and each
+ * centroid is compared with all of them at once. The squared distance
+ * is summed in float, dimension by dimension, exactly
+ * like the plain loop; this file is compiled with -ffp-contract=off so
+ * that no multiply-add gets fused. A point moves to a centroid whenever
+ * its distance is <= the smallest so far. So every version gives the
+ * same assignments.
+ *
+ * For Hamerly and Elkan, which look at one point at a time, dists() turns
+ * this around: a register holds the distances to several centroids, each
+ * summed over the dimensions in the same order again.
+ *
+ * Each search is written once, as an inline body taking D. The common D
+ * get a function of their own that passes it as a constant, so that the
+ * loop over the dimensions is unrolled and 2-D points are as fast as
+ * with a dedicated x/y kernel.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/kmeans_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KMEANS_X86
+#endif
+
+#define INLINE static inline __attribute__((always_inline))
+
+/* Instantiate the search `isa` for any D and for each of KMEANS_FIXED_DIMS */
+#define NEAREST_D(isa, attr, D)                                                                                \
+    attr static void nearest_##isa##_##D(const float *x, size_t stride, int n, int dims, const float *centroid, \
+                                         int k, int *near)                                                     \
+    {                                                                                                          \
+        (void)dims;                                                                                            \
+        nearest_##isa##_body(x, stride, n, D, centroid, k, near);                                              \
+    }
+#define NEAREST(isa, attr)                                                                                     \
+    attr static void nearest_##isa(const float *x, size_t stride, int n, int D, const float *centroid, int k,  \
+                                   int *near)                                                                  \
+    {                                                                                                          \
+        nearest_##isa##_body(x, stride, n, D, centroid, k, near);                                              \
+    }                                                                                                          \
+    NEAREST_D(isa, attr, 2)                                                                                    \
+    NEAREST_D(isa, attr, 3)                                                                                    \
+    NEAREST_D(isa, attr, 4)                                                                                    \
+    NEAREST_D(isa, attr, 8)                                                                                    \
+    NEAREST_D(isa, attr, 16)                                                                                   \
+    NEAREST_D(isa, attr, 32)                                                                                   \
+    NEAREST_D(isa, attr, 64)
+#define NEAREST_TABLE(isa)                                                                                     \
+    nearest_##isa, {nearest_##isa##_2, nearest_##isa##_3, nearest_##isa##_4, nearest_##isa##_8,               \
+                    nearest_##isa##_16, nearest_##isa##_32, nearest_##isa##_64 }
+
+INLINE void nearest_generic_body(const float *x, size_t stride, int n, int D, const float *centroid, int k,
+                                 int *near)
+{
+    for (int i = 0; i < n; i++)
+    {
+        float min_dist = INFINITY;
+        int nearest_cluster = -1;
+        for (int c = 0; c < k; c++)
+        {
+            const float *m = centroid + (size_t)c * D;
+            float dist = (x[i] - m[0]) * (x[i] - m[0]);
+            for (int d = 1; d < D; d++)
+            {
+                float dx = x[d * stride + i] - m[d];
+                dist += dx * dx;
+            }
+            if (dist <= min_dist)
+            {
+                min_dist = dist;
+                nearest_cluster = c;
+            }
+        }
+        near[i] = nearest_cluster;
+    }
+}
+
+NEAREST(generic, )
+
+static void dists_generic(const float *x, size_t stride, int D, const float *centroid_t, int k, float *dist)
+{
+    for (int c = 0; c < k; c++)
+    {
+        float dx0 = x[0] - centroid_t[c];
+        dist[c] = dx0 * dx0;
+    }
+    for (int d = 1; d < D; d++)
+    {
+        for (int c = 0; c < k; c++)
+        {
+            float dx = x[d * stride] - centroid_t[(size_t)d * k + c];
+            dist[c] += dx * dx;
+        }
+    }
+}
+
+static const struct kmeans_simd simd_generic = {"generic", NEAREST_TABLE(generic), dists_generic};
+
+#ifdef KMEANS_X86
+
+/* AVX2: 8 points per register, the rest done by the plain loop */
+
+INLINE __attribute__((target("avx2"))) void nearest_avx2_body(const float *x, size_t stride, int n, int D,
+                                                              const float *centroid, int k, int *near)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 min_dist = _mm256_set1_ps(INFINITY);
+        __m256i best = _mm256_set1_epi32(-1);
+        for (int c = 0; c < k; c++)
+        {
+            const float *m = centroid + (size_t)c * D;
+            __m256 dx0 = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_set1_ps(m[0]));
+            __m256 dist = _mm256_mul_ps(dx0, dx0);
+            for (int d = 1; d < D; d++)
+            {
+                __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + d * stride + i), _mm256_set1_ps(m[d]));
+                dist = _mm256_add_ps(dist, _mm256_mul_ps(dx, dx));
+            }
+            __m256 closer = _mm256_cmp_ps(dist, min_dist, _CMP_LE_OQ);
+            min_dist = _mm256_blendv_ps(min_dist, dist, closer);
+            best = _mm256_blendv_epi8(best, _mm256_set1_epi32(c), _mm256_castps_si256(closer));
+        }
+        _mm256_storeu_si256((__m256i *)(near + i), best);
+    }
+    nearest_generic_body(x + i, stride, n - i, D, centroid, k, near + i);
+}
+
+NEAREST(avx2, __attribute__((target("avx2"))))
+
+__attribute__((target("avx2"))) static void dists_avx2(const float *x, size_t stride, int D,
+                                                       const float *centroid_t, int k, float *dist)
+{
+    int c = 0;
+    for (; c + 8 <= k; c += 8)
+    {
+        __m256 dx0 = _mm256_sub_ps(_mm256_set1_ps(x[0]), _mm256_loadu_ps(centroid_t + c));
+        __m256 sum = _mm256_mul_ps(dx0, dx0);
+        for (int d = 1; d < D; d++)
+        {
+            __m256 dx = _mm256_sub_ps(_mm256_set1_ps(x[d * stride]), _mm256_loadu_ps(centroid_t + (size_t)d * k + c));
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(dx, dx));
+        }
+        _mm256_storeu_ps(dist + c, sum);
+    }
+    for (; c < k; c++)
+    {
+        float dx0 = x[0] - centroid_t[c];
+        dist[c] = dx0 * dx0;
+        for (int d = 1; d < D; d++)
+        {
+            float dx = x[d * stride] - centroid_t[(size_t)d * k + c];
+            dist[c] += dx * dx;
+        }
+    }
+}
+
+static const struct kmeans_simd simd_avx2 = {"avx2", NEAREST_TABLE(avx2), dists_avx2};
+
+/* AVX-512: 16 points per register, the tail is done with masked loads and stores */
+
+INLINE __attribute__((target("avx512f"))) void nearest_avx512_body(const float *x, size_t stride, int n, int D,
+                                                                   const float *centroid, int k, int *near)
+{
+    for (int i = 0; i < n; i += 16)
+    {
+        __mmask16 mask = (n - i >= 16) ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+        __m512 min_dist = _mm512_set1_ps(INFINITY);
+        __m512i best = _mm512_set1_epi32(-1);
+        for (int c = 0; c < k; c++)
+        {
+            const float *m = centroid + (size_t)c * D;
+            __m512 dx0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x + i), _mm512_set1_ps(m[0]));
+            __m512 dist = _mm512_mul_ps(dx0, dx0);
+            for (int d = 1; d < D; d++)
+            {
+                __m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x + d * stride + i), _mm512_set1_ps(m[d]));
+                dist = _mm512_add_ps(dist, _mm512_mul_ps(dx, dx));
+            }
+            __mmask16 closer = _mm512_cmp_ps_mask(dist, min_dist, _CMP_LE_OQ);
+            min_dist = _mm512_mask_blend_ps(closer, min_dist, dist);
+            best = _mm512_mask_blend_epi32(closer, best, _mm512_set1_epi32(c));
+        }
+        _mm512_mask_storeu_epi32(near + i, mask, best);
+    }
+}
+
+NEAREST(avx512, __attribute__((target("avx512f"))))
+
+__attribute__((target("avx512f"))) static void dists_avx512(const float *x, size_t stride, int D,
+                                                            const float *centroid_t, int k, float *dist)
+{
+    for (int c = 0; c < k; c += 16)
+    {
+        __mmask16 mask = (k - c >= 16) ? 0xffff : (__mmask16)((1u << (k - c)) - 1);
+        __m512 dx0 = _mm512_sub_ps(_mm512_set1_ps(x[0]), _mm512_maskz_loadu_ps(mask, centroid_t + c));
+        __m512 sum = _mm512_mul_ps(dx0, dx0);
+        for (int d = 1; d < D; d++)
+        {
+            __m512 dx = _mm512_sub_ps(_mm512_set1_ps(x[d * stride]),
+                                      _mm512_maskz_loadu_ps(mask, centroid_t + (size_t)d * k + c));
+            sum = _mm512_add_ps(sum, _mm512_mul_ps(dx, dx));
+        }
+        _mm512_mask_storeu_ps(dist + c, mask, sum);
+    }
+}
+
+static const struct kmeans_simd simd_avx512 = {"avx512", NEAREST_TABLE(avx512), dists_avx512};
+
+#endif // KMEANS_X86
+
+static const struct kmeans_simd *chosen = &simd_generic;
+static pthread_once_t chosen_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Take the widest kernel the CPU supports. KMEANS_SIMD=avx2 (or generic)
+ * in the environment caps it, for comparing the kernels.
+ */
+static void choose_simd(void)
+{
+#ifdef KMEANS_X86
+    const char *cap = getenv("KMEANS_SIMD");
+    const struct kmeans_simd *order[] = {&simd_avx512, &simd_avx2};
+    int i = 0;
+
+    if (cap != NULL && strcmp(cap, "generic") == 0)
+        return;
+    if (cap != NULL)
+    {
+        while (i < 2 && strcmp(order[i]->name, cap) != 0)
+            i++;
+        if (i == 2) // Unknown name, no cap
+            i = 0;
+    }
+    __builtin_cpu_init();
+    for (; i < 2; i++)
+    {
+        if ((order[i] == &simd_avx512 && __builtin_cpu_supports("avx512f")) ||
+            (order[i] == &simd_avx2 && __builtin_cpu_supports("avx2")))
+        {
+            chosen = order[i];
+            return;
+        }
+    }
+#endif
+}
+
+/*
+ * The nearest-centroid search for this CPU, chosen on the first call.
+ */
+const struct kmeans_simd *kmeans_simd(void)
+{
+    pthread_once(&chosen_once, choose_simd);
+    return chosen;
+}
+
+/*
+ * The squared distance between the point at x (coordinate d at
+ * x[d * stride]) and the centroid at m, to the bit as the searches
+ * compute it.
+ */
+float kmeans_dist(const float *x, size_t stride, int D, const float *m)
+{
+    float dist = (x[0] - m[0]) * (x[0] - m[0]);
+    for (int d = 1; d < D; d++)
+    {
+        float dx = x[d * stride] - m[d];
+        dist += dx * dx;
+    }
+    return dist;
+}
+
+/*
+ * The fastest search for points of D dimensions on this CPU.
+ */
+kmeans_nearest_fn kmeans_nearest(int D)
+{
+    static const int fixed_dims[KMEANS_NFIXED] = KMEANS_FIXED_DIMS;
+    const struct kmeans_simd *simd = kmeans_simd();
+
+    for (int i = 0; i < KMEANS_NFIXED; i++)
+    {
+        if (fixed_dims[i] == D)
+            return simd->fixed[i];
+    }
+    return simd->nearest;
+}
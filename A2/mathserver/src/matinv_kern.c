@@ -0,0 +1,1138 @@
+/***************************************************************************
+ *
+ * Parallel Matrix Inverse kernel (libmathkern)
+ * An adapted version of the code by Håkan Grahn
+ * All state lives in a `struct matinv`, so the server can run several
+ * problems at once in one process.
+ *
+ ***************************************************************************/
+
+#define _GNU_SOURCE // random_r
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <math.h>
+#include <unistd.h>
+#include <float.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/matinv_kern.h"
+#include "../include/matinv_simd.h"
+#include "../include/fmt_util.h"
+#include "../include/numa_util.h"
+
+/* A worker's pivot candidate, one cache line each so that proposing does not bounce lines */
+struct pivot_slot
+{
+    double value;
+    int row; // -1 if the worker has no rows left
+} __attribute__((aligned(MATINV_ALIGN)));
+
+// Holds the workers back until all of them are created
+struct gate
+{
+    pthread_mutex_t lock; // Held while the workers are created
+    int abort;            // One could not be, the others return at once
+};
+
+struct threadArgs
+{
+    struct matinv *m;
+    struct gate *gate;          // Passed by each worker before it starts
+    pthread_barrier_t *barrier; // Shared by all workers, passed once per pivot
+    int nthreads;
+    int id;
+    int start, end;            // This worker's rows, end not inclusive
+    struct pivot_slot *slots;  // Proposals for the next pivot, [2][nthreads]
+    char *used;                // used[row]: row was a pivot already, written by the row's owner
+    double *P;        // Blocked: the panel, N rows of [A columns | transformation columns]
+    double *RA, *RI; // Blocked: the panel's pivot rows of A and I before the panel
+};
+
+// forward declarations
+static void worker_args(struct matinv *m, struct threadArgs *args, int i);
+static int run_workers(struct matinv *m, void *(*worker)(void *), struct threadArgs *args);
+static int gate_pass(struct threadArgs *args);
+static void *touch_rows(void *params);
+static void *eliminate_rows(void *params);
+static void *eliminate_blocked(void *params);
+static void divide_row(struct matinv *m, int row, int p);
+static void measure_input(struct matinv *m);
+
+// Row `row` of matrix M
+static inline double *row_of(double *M, size_t ld, int row)
+{
+    return M + (size_t)row * ld;
+}
+
+// init default values
+void matinv_default_options(struct matinv_options *opt)
+{
+    opt->N = 5;
+    opt->Init = "fast";
+    opt->maxnum = 15.0;
+    opt->PRINT = 1;
+    opt->threads = sysconf(_SC_NPROCESSORS_ONLN);
+    opt->algorithm = "basic";
+    opt->verbose = 0;
+    opt->hugepages = 0;
+    opt->maxcond = 0;
+    opt->input_path = NULL;
+    opt->format = MATINV_OUT_TEXT;
+    opt->cpus = NULL;
+}
+
+// Report an option given without its value, returns -1
+static int missing_value(char *option, FILE *out)
+{
+    fprintf(out, "Error: option -%s needs a value\n", option);
+    return -1;
+}
+
+/*
+ * Read arguments. Returns 1 if only help or the defaults were asked for
+ * (already printed to `out`), so nothing should be computed, and -1 if
+ * an option is missing its value.
+ */
+int matinv_read_options(struct matinv_options *opt, int argc, char *argv[], FILE *out)
+{
+    while (++argv, --argc > 0)
+    {
+        if (**argv == '-')
+        {
+            switch (*++*argv)
+            {
+            case 'n':
+                if (argc < 2)
+                    return missing_value(*argv, out);
+                --argc;
+                opt->N = atoi(*++argv);
+                break;
+            case 'h':
+                fprintf(out, "\nHELP: try matinv -u \n\n");
+                return 1;
+            case 'u':
+                fprintf(out, "\nUsage: matinv [-n problemsize]\n");
+                fprintf(out, "           [-D] show default values \n");
+                fprintf(out, "           [-h] help \n");
+                fprintf(out, "           [-I init_type] fast/rand \n");
+                fprintf(out, "           [-f file] binary matrix file instead of -I \n");
+                fprintf(out, "           [-m maxnum] max random no \n");
+                fprintf(out, "           [-P print_switch] 0/1 \n");
+                fprintf(out, "           [-t threads] worker threads (default: online CPUs) \n");
+                fprintf(out, "           [-a algorithm] basic/blocked \n");
+                fprintf(out, "           [-v] report the SIMD kernel \n");
+                fprintf(out, "           [-H] use huge pages for the matrices \n");
+                fprintf(out, "           [-c maxcond] reject worse conditioned matrices \n");
+                fprintf(out, "           [-O format] text/exact/binary output \n");
+                fprintf(out, "           [--cpus list] pin the workers, e.g. 0-7,16-23 \n");
+                return 1;
+            case 'D':
+                fprintf(out, "\nDefault:  n         = %d ", opt->N);
+                fprintf(out, "\n          Init      = rand");
+                fprintf(out, "\n          maxnum    = 5 ");
+                fprintf(out, "\n          P         = 0 \n\n");
+                return 1;
+            case 'I':
+                if (argc < 2)
+                    return missing_value(*argv, out);
+                --argc;
+                opt->Init = *++argv;
+                break;
+            case 'm':
+                if (argc < 2)
+                    return missing_value(*argv, out);
+                --argc;
+                opt->maxnum = atoi(*++argv);
+                break;
+            case 'P':
+                if (argc < 2)
+                    return missing_value(*argv, out);
+                --argc;
+                opt->PRINT = atoi(*++argv);
+                break;
+            case 't':
+                if (argc < 2)
+                    return missing_value(*argv, out);
+                --argc;
+                opt->threads = atoi(*++argv);
+                break;
+            case 'a':
+                if (argc < 2)
+                    return missing_value(*argv, out);
+                --argc;
+                opt->algorithm = *++argv;
+                break;
+            case 'v':
+                opt->verbose = 1;
+                break;
+            case 'H':
+                opt->hugepages = 1;
+                break;
+            case 'f':
+                if (argc < 2)
+                    return missing_value(*argv, out);
+                --argc;
+                opt->input_path = *++argv;
+                break;
+            case 'O':
+                if (argc < 2)
+                    return missing_value(*argv, out);
+                --argc;
+                ++argv;
+                if (strcmp(*argv, "exact") == 0)
+                    opt->format = MATINV_OUT_EXACT;
+                else if (strcmp(*argv, "binary") == 0)
+                    opt->format = MATINV_OUT_BINARY;
+                else
+                    opt->format = MATINV_OUT_TEXT;
+                break;
+            case 'c':
+                if (argc < 2)
+                    return missing_value(*argv, out);
+                --argc;
+                opt->maxcond = atof(*++argv);
+                break;
+            case '-':
+                if (strcmp(*argv, "-cpus") == 0)
+                {
+                    if (argc < 2)
+                        return missing_value(*argv, out);
+                    --argc;
+                    opt->cpus = *++argv;
+                }
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * A zeroed matrix of `*bytes` bytes, straight from mmap so that it is
+ * page aligned and its pages are only touched when used. With `huge`,
+ * the size is rounded up to whole 2 MiB pages (stored back in `*bytes`)
+ * and explicit huge pages are tried first, then transparent ones.
+ */
+static double *matrix_alloc(size_t *bytes, int huge)
+{
+    void *M = MAP_FAILED;
+    if (huge)
+    {
+        size_t page = 2 << 20;
+        *bytes = (*bytes + page - 1) / page * page;
+        M = mmap(NULL, *bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (M == MAP_FAILED)
+    {
+        M = mmap(NULL, *bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (M == MAP_FAILED)
+            return NULL;
+        if (huge)
+            madvise(M, *bytes, MADV_HUGEPAGE);
+    }
+    return M;
+}
+
+/*
+ * Allocate A and I for an N x N problem, I set to the identity.
+ * Returns -1, reported to `out`, if N is out of range or memory is short.
+ */
+static int matinv_alloc(struct matinv *m, struct matinv_options *opt, int N, FILE *out)
+{
+    memset(m, 0, sizeof(struct matinv));
+    if (N < 1 || N > MAX_SIZE)
+    {
+        fprintf(out, "Matrix size must be between 1 and %d\n", MAX_SIZE);
+        return -1;
+    }
+    if (opt->threads < 1)
+    {
+        opt->threads = 1;
+    }
+
+    m->N = N;
+    m->threads = (opt->threads < N) ? opt->threads : N; // At least one row each
+    m->blocked = (strcmp(opt->algorithm, "blocked") == 0);
+    m->format = opt->format;
+    m->simd = matinv_simd();
+    m->ld = (N + MATINV_ALIGN / sizeof(double) - 1) / (MATINV_ALIGN / sizeof(double)) * (MATINV_ALIGN / sizeof(double));
+    m->bytes = m->ld * N * sizeof(double);
+    m->A = matrix_alloc(&m->bytes, opt->hugepages);
+    m->I = matrix_alloc(&m->bytes, opt->hugepages);
+    m->perm = malloc(N * sizeof(int));
+    m->check = malloc(N * sizeof(double));
+    if (m->A == NULL || m->I == NULL || m->perm == NULL || m->check == NULL)
+    {
+        matinv_free(m);
+        fprintf(out, "Cannot allocate matrices\n");
+        return -1;
+    }
+    if (opt->cpus != NULL && (m->ncpus = cpulist_parse(opt->cpus, &m->cpus)) == -1)
+    {
+        m->ncpus = 0;
+        matinv_free(m);
+        fprintf(out, "Bad CPU list %s\n", opt->cpus);
+        return -1;
+    }
+
+    for (int row = 0; row < N; row++)
+    {
+        m->perm[row] = row;
+    }
+    if (m->cpus != NULL)
+    {
+        // NUMA: each worker faults in its own rows, so they are on its node
+        struct threadArgs *args = malloc(m->threads * sizeof(struct threadArgs));
+        if (args != NULL)
+        {
+            for (int i = 0; i < m->threads; i++)
+                worker_args(m, &args[i], i);
+            int err = run_workers(m, touch_rows, args);
+            free(args);
+            if (err == 0)
+                return 0;
+        }
+    }
+
+    // Set the diagonal elements of the inverse matrix to 1.0
+    // So that you get an identity matrix to begin with
+    for (int row = 0; row < N; row++)
+    {
+        row_of(m->I, m->ld, row)[row] = 1.0;
+    }
+    return 0;
+}
+
+/*
+ * Worker of the first touch: zero this worker's rows of A and I and set
+ * the diagonal of I, pinned where it will invert them.
+ */
+static void *touch_rows(void *params)
+{
+    struct threadArgs *args = (struct threadArgs *)params;
+    struct matinv *m = args->m;
+
+    if (!gate_pass(args))
+        return NULL;
+    for (int row = args->start; row < args->end; row++)
+    {
+        memset(row_of(m->A, m->ld, row), 0, m->ld * sizeof(double));
+        memset(row_of(m->I, m->ld, row), 0, m->ld * sizeof(double));
+        row_of(m->I, m->ld, row)[row] = 1.0;
+    }
+    return NULL;
+}
+
+// A is filled in: measure it and show it
+static void matinv_ready(struct matinv *m, struct matinv_options *opt, FILE *out)
+{
+    measure_input(m);
+    fprintf(out, "done \n\n");
+    if (m->cpus != NULL)
+    {
+        numa_report(out, "A memory", m->A, m->bytes);
+        numa_report(out, "I memory", m->I, m->bytes);
+        fprintf(out, "\n");
+    }
+    if (opt->PRINT == 1 && m->format != MATINV_OUT_BINARY)
+    {
+        matinv_print(m, m->A, "Begin: Input", out);
+    }
+}
+
+/*
+ * Allocate and initialize the matrices described by `opt`, reporting to `out`.
+ * Returns -1 if the size is out of range or memory is short.
+ */
+int matinv_init(struct matinv *m, struct matinv_options *opt, FILE *out)
+{
+    int row, col;
+    int N = opt->N;
+
+    if (opt->maxnum < 1)
+    {
+        opt->maxnum = 1;
+    }
+    if (matinv_alloc(m, opt, N, out) == -1)
+    {
+        return -1;
+    }
+    double *A = m->A;
+    size_t ld = m->ld;
+
+    fprintf(out, "\nsize      = %dx%d ", N, N);
+    fprintf(out, "\nmaxnum    = %d \n", opt->maxnum);
+    fprintf(out, "Init	  = %s \n", opt->Init);
+    if (opt->verbose)
+    {
+        fprintf(out, "kernel    = %s \n", m->simd->name);
+    }
+    fprintf(out, "Initializing matrix...");
+
+    if (strcmp(opt->Init, "rand") == 0)
+    {
+        // Same sequence as rand() without srand(), but private to this problem
+        struct random_data rnd;
+        char state[128];
+        int32_t r;
+        memset(&rnd, 0, sizeof(rnd));
+        initstate_r(1, state, sizeof(state), &rnd);
+
+        for (row = 0; row < N; row++)
+        {
+            for (col = 0; col < N; col++)
+            {
+                random_r(&rnd, &r);
+                if (row == col) // diagonal dominance
+                    row_of(A, ld, row)[col] = (double)(r % opt->maxnum) + 5.0;
+                else
+                    row_of(A, ld, row)[col] = (double)(r % opt->maxnum) + 1.0;
+            }
+        }
+    }
+
+    if (strcmp(opt->Init, "fast") == 0)
+    {
+        for (row = 0; row < N; row++)
+        {
+            for (col = 0; col < N; col++)
+            {
+                if (row == col) // diagonal dominance
+                    row_of(A, ld, row)[col] = 5.0;
+                else
+                    row_of(A, ld, row)[col] = 2.0;
+            }
+        }
+    }
+
+    matinv_ready(m, opt, out);
+    return 0;
+}
+
+// Little-endian field of a matrix file header
+static uint64_t get_le(const unsigned char *p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static void put_le(unsigned char *p, uint64_t v, int bytes)
+{
+    for (int i = 0; i < bytes; i++, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+/*
+ * Set up the problem from a matrix file (format in matinv_kern.h) that
+ * is `len` bytes at `buf`, reporting to `out`. The elements are copied
+ * into A as they are, without any parsing. Returns -1 if the file is
+ * not a valid matrix or memory is short.
+ */
+int matinv_load(struct matinv *m, struct matinv_options *opt, const char *buf, size_t len, FILE *out)
+{
+    const unsigned char *hdr = (const unsigned char *)buf;
+
+    memset(m, 0, sizeof(struct matinv));
+    if (len < MATINV_FILE_HDR || memcmp(hdr, MATINV_FILE_MAGIC, 4) != 0 ||
+        get_le(hdr + 4, 4) != MATINV_FILE_VERSION)
+    {
+        fprintf(out, "Not a matrix file\n");
+        return -1;
+    }
+    uint64_t N = get_le(hdr + 8, 8);
+    uint32_t dtype = get_le(hdr + 16, 4), layout = get_le(hdr + 20, 4);
+    if (dtype != MATINV_F64 || (layout != MATINV_ROW_MAJOR && layout != MATINV_COL_MAJOR))
+    {
+        fprintf(out, "Unsupported matrix element type or layout\n");
+        return -1;
+    }
+    if (N < 1 || N > MAX_SIZE)
+    {
+        fprintf(out, "Matrix size must be between 1 and %d\n", MAX_SIZE);
+        return -1;
+    }
+    if ((len - MATINV_FILE_HDR) / sizeof(double) / N < N)
+    {
+        fprintf(out, "Matrix file is truncated\n");
+        return -1;
+    }
+    if (matinv_alloc(m, opt, N, out) == -1)
+    {
+        return -1;
+    }
+
+    fprintf(out, "\nsize      = %dx%d ", m->N, m->N);
+    fprintf(out, "\nInit	  = file \n");
+    if (opt->verbose)
+    {
+        fprintf(out, "kernel    = %s \n", m->simd->name);
+    }
+    fprintf(out, "Loading matrix...");
+
+    const char *data = buf + MATINV_FILE_HDR;
+    for (int row = 0; row < m->N; row++)
+    {
+        double *a = row_of(m->A, m->ld, row);
+        if (layout == MATINV_ROW_MAJOR && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+        {
+            memcpy(a, data + (size_t)row * N * sizeof(double), N * sizeof(double));
+            continue;
+        }
+        for (int col = 0; col < m->N; col++)
+        {
+            size_t i = (layout == MATINV_ROW_MAJOR) ? (size_t)row * N + col : (size_t)col * N + row;
+            uint64_t bits = get_le((const unsigned char *)data + i * sizeof(double), 8);
+            memcpy(&a[col], &bits, sizeof(double));
+        }
+    }
+
+    matinv_ready(m, opt, out);
+    return 0;
+}
+
+/*
+ * matinv_load() on the file at `path`, mapped rather than read.
+ */
+int matinv_load_file(struct matinv *m, struct matinv_options *opt, const char *path, FILE *out)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        fprintf(out, "Cannot open %s\n", path);
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return matinv_load(m, opt, "", 0, out);
+    }
+
+    char *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+    {
+        fprintf(out, "Cannot map %s\n", path);
+        return -1;
+    }
+    madvise(buf, st.st_size, MADV_SEQUENTIAL);
+    int rc = matinv_load(m, opt, buf, st.st_size, out);
+    munmap(buf, st.st_size);
+    return rc;
+}
+
+/*
+ * What matinv_report() needs to know about A, which the inversion
+ * overwrites: its 1-norm and A * (1, ..., 1). O(N^2).
+ */
+static void measure_input(struct matinv *m)
+{
+    double *colsum = calloc(m->N, sizeof(double));
+
+    m->anorm = 0.0;
+    for (int row = 0; row < m->N; row++)
+    {
+        const double *a = row_of(m->A, m->ld, row);
+        double sum = 0.0;
+        for (int col = 0; col < m->N; col++)
+        {
+            sum += a[col];
+            if (colsum != NULL)
+                colsum[col] += fabs(a[col]);
+        }
+        m->check[row] = sum;
+    }
+    for (int col = 0; colsum != NULL && col < m->N; col++)
+    {
+        if (colsum[col] > m->anorm)
+            m->anorm = colsum[col];
+    }
+    free(colsum);
+}
+
+/*
+ * Report on the health of the inverse X: the condition number
+ * |A|_1 * |X|_1 and the residual max |X * (A * 1) - 1|, both O(N^2).
+ * Returns -1 if there is no inverse worth printing: the inversion could
+ * not run, A is singular, or worse conditioned than `opt->maxcond` allows.
+ */
+int matinv_report(struct matinv *m, struct matinv_options *opt, FILE *out)
+{
+    if (m->error != 0)
+    {
+        fprintf(out, "Error: cannot invert: %s\n", strerror(m->error));
+        return -1;
+    }
+    if (m->singular)
+    {
+        fprintf(out, "Matrix is singular to working precision\n");
+        return -1;
+    }
+
+    double *colsum = calloc(m->N, sizeof(double));
+    double xnorm = 0.0, residual = 0.0;
+    if (colsum == NULL)
+    {
+        return 0;
+    }
+    for (int row = 0; row < m->N; row++)
+    {
+        const double *x = matinv_row(m, m->I, row);
+        double sum = 0.0;
+        for (int col = 0; col < m->N; col++)
+        {
+            sum += x[col] * m->check[col];
+            colsum[col] += fabs(x[col]);
+        }
+        if (fabs(sum - 1.0) > residual)
+            residual = fabs(sum - 1.0);
+    }
+    for (int col = 0; col < m->N; col++)
+    {
+        if (colsum[col] > xnorm)
+            xnorm = colsum[col];
+    }
+    free(colsum);
+
+    double cond = m->anorm * xnorm;
+    fprintf(out, "cond      = %.3e \n", cond);
+    fprintf(out, "residual  = %.3e \n\n", residual);
+    if (opt->maxcond > 0 && cond > opt->maxcond)
+    {
+        fprintf(out, "Rejected: condition number over %.3e\n", opt->maxcond);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Row `row` of M in the order of the problem: after the inversion, rows
+ * of I and A are where the pivoting left them.
+ */
+double *matinv_row(struct matinv *m, double *M, int row)
+{
+    return row_of(M, m->ld, m->perm[row]);
+}
+
+/*
+ * Invert A into I with partial pivoting. Returns -1, with the work
+ * abandoned half-way, if A is singular to working precision, and
+ * without doing it if memory or threads are short (m->error).
+ */
+int matinv_invert(struct matinv *m)
+{
+    int nthreads = m->threads;
+    pthread_barrier_t barrier;
+    struct threadArgs *args = malloc(nthreads * sizeof(struct threadArgs)); // argument buffer
+
+    // Two rounds of proposals: one being read while the next is written
+    struct pivot_slot *slots = aligned_alloc(MATINV_ALIGN, 2 * nthreads * sizeof(struct pivot_slot));
+    char *used = calloc(m->N, 1);
+
+    void *(*worker)(void *) = m->blocked ? eliminate_blocked : eliminate_rows;
+    double *P = NULL, *RA = NULL, *RI = NULL;
+    if (m->blocked)
+    {
+        P = aligned_alloc(MATINV_ALIGN, (size_t)m->N * 2 * MATINV_BLOCK * sizeof(double));
+        RA = aligned_alloc(MATINV_ALIGN, (size_t)MATINV_BLOCK * m->ld * sizeof(double));
+        RI = aligned_alloc(MATINV_ALIGN, (size_t)MATINV_BLOCK * m->ld * sizeof(double));
+    }
+
+    m->singular = 0;
+    m->error = 0;
+    if (args == NULL || slots == NULL || used == NULL ||
+        (m->blocked && (P == NULL || RA == NULL || RI == NULL)))
+    {
+        m->error = ENOMEM;
+        free(P);
+        free(RA);
+        free(RI);
+        free(slots);
+        free(used);
+        free(args);
+        return -1;
+    }
+
+    // The workers live for the whole inversion and meet at the barrier after each pivot
+    pthread_barrier_init(&barrier, NULL, nthreads);
+    for (int i = 0; i < nthreads; i++)
+    {
+        worker_args(m, &args[i], i);
+        args[i].barrier = &barrier;
+        args[i].slots = slots;
+        args[i].used = used;
+        args[i].P = P;
+        args[i].RA = RA;
+        args[i].RI = RI;
+    }
+    m->error = run_workers(m, worker, args);
+    pthread_barrier_destroy(&barrier);
+    free(P);
+    free(RA);
+    free(RI);
+    free(slots);
+    free(used);
+    free(args);
+    return (m->error != 0 || m->singular) ? -1 : 0;
+}
+
+// Worker i of m->threads and its block of rows, the same for every phase
+static void worker_args(struct matinv *m, struct threadArgs *args, int i)
+{
+    memset(args, 0, sizeof(*args));
+    args->m = m;
+    args->nthreads = m->threads;
+    args->id = i;
+    args->start = (long)m->N * i / m->threads;
+    args->end = (long)m->N * (i + 1) / m->threads;
+}
+
+// Wait for the gate to open. Returns 0 if the workers are abandoned.
+static int gate_pass(struct threadArgs *args)
+{
+    pthread_mutex_lock(&args->gate->lock);
+    int go = !args->gate->abort;
+    pthread_mutex_unlock(&args->gate->lock);
+    return go;
+}
+
+/*
+ * Run `worker` on each of the m->threads `args`, the calling thread being
+ * worker 0, and wait for all of them. With a CPU list, worker i runs on
+ * cpus[i % ncpus]; the calling thread gets its affinity back afterwards.
+ * The workers wait at a gate until all are created. If one cannot be,
+ * none does any work, and the error number is returned; 0 otherwise.
+ */
+static int run_workers(struct matinv *m, void *(*worker)(void *), struct threadArgs *args)
+{
+    int nthreads = m->threads;
+    pthread_t *children = malloc(nthreads * sizeof(pthread_t)); // dynamic array of child threads
+    struct gate gate = {PTHREAD_MUTEX_INITIALIZER, 0};
+    pthread_attr_t attr;
+    cpu_set_t saved;
+    int pinned = 0, started, err = 0;
+
+    if (children == NULL)
+    {
+        return ENOMEM;
+    }
+    for (int i = 0; i < nthreads; i++)
+    {
+        args[i].gate = &gate;
+    }
+    pthread_mutex_lock(&gate.lock);
+    for (started = 1; started < nthreads; started++)
+    {
+        pthread_attr_init(&attr);
+        if (m->cpus != NULL)
+            pin_attr(&attr, m->cpus[started % m->ncpus]);
+        err = pthread_create(&(children[started]),    // our handle for the child
+                             &attr,                   // attributes of the child
+                             worker,                  // the function it should run
+                             (void *)&args[started]); // args to that function
+        pthread_attr_destroy(&attr);
+        if (err != 0)
+        {
+            gate.abort = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&gate.lock);
+
+    if (err == 0)
+    {
+        if (m->cpus != NULL)
+            pinned = (pin_self(m->cpus[0], &saved) == 0);
+        worker(&args[0]); // The calling thread is worker 0
+        if (pinned)
+            unpin_self(&saved);
+    }
+    for (int j = 1; j < started; j++)
+    {
+        pthread_join(children[j], NULL);
+    }
+    free(children);
+    return err;
+}
+
+/*
+ * Propose this worker's pivot for column `col` of M (row stride `stride`):
+ * its row with the largest |M[row][col]| among those not used as a pivot yet.
+ */
+static void propose_pivot(struct threadArgs *args, const double *M, size_t stride, int col,
+                          struct pivot_slot *slot)
+{
+    slot->row = -1;
+    slot->value = 0.0;
+    for (int row = args->start; row < args->end; row++)
+    {
+        double v = M[(size_t)row * stride + col];
+        if (!args->used[row] && (slot->row == -1 || fabs(v) > fabs(slot->value)))
+        {
+            slot->row = row;
+            slot->value = v;
+        }
+    }
+}
+
+/*
+ * Reduce the workers' proposals to the pivot: the largest magnitude, the
+ * lowest row on ties. Every worker computes it from the same proposals,
+ * so all of them agree without another barrier. Returns -1 if the best
+ * is too small to divide by, i.e. A is singular to working precision.
+ */
+static int choose_pivot(struct threadArgs *args, const struct pivot_slot *slots, double *pivalue)
+{
+    const struct pivot_slot *best = NULL;
+    for (int i = 0; i < args->nthreads; i++)
+    {
+        const struct pivot_slot *s = slots + i;
+        if (s->row != -1 && (best == NULL || fabs(s->value) > fabs(best->value) ||
+                             (fabs(s->value) == fabs(best->value) && s->row < best->row)))
+            best = s;
+    }
+    if (best == NULL || fabs(best->value) <= DBL_EPSILON * args->m->anorm)
+    {
+        if (args->id == 0)
+            args->m->singular = 1;
+        return -1;
+    }
+    *pivalue = best->value;
+    return best->row;
+}
+
+// Division step on pivot row `row`, so that its element in column p becomes 1
+static void divide_row(struct matinv *m, int row, int p)
+{
+    double *A = row_of(m->A, m->ld, row), *I = row_of(m->I, m->ld, row);
+    double pivalue = A[p]; // pivot value
+
+    for (int col = 0; col < m->N; col++)
+    {
+        A[col] = A[col] / pivalue; // Division step on A
+        I[col] = I[col] / pivalue; // Division step on I
+    }
+}
+
+/*
+ * Worker: for every pivot p, eliminate column p from this worker's block
+ * of rows, with the row of the largest |A[row][p]| among the rows not yet
+ * used as pivot. Rows are never swapped; perm[p] records which row it
+ * was. While eliminating, every worker already proposes its candidate
+ * for column p + 1, so a single barrier per pivot is enough. Everybody
+ * eliminates with the pivot row as it is, and its owner divides it only
+ * in the next step, when nobody else reads it any more.
+ */
+static void *eliminate_rows(void *params)
+{
+    struct threadArgs *args = (struct threadArgs *)params;
+    struct matinv *m = args->m;
+    double multiplier, pivalue;
+    int row, p, piv = -1; // 'p' stands for pivot (numbered from 0 to N-1), `piv` is its row
+    int N = m->N;
+    double *A = m->A, *I = m->I;
+    size_t ld = m->ld;
+    const struct matinv_simd *simd = m->simd;
+
+    if (!gate_pass(args))
+        return NULL;
+    propose_pivot(args, A, ld, 0, &args->slots[args->id]);
+    pthread_barrier_wait(args->barrier);
+
+    // Bringing the matrix A to the identity form
+    for (p = 0; p < N; p++)
+    {
+        if (piv >= args->start && piv < args->end)
+        {
+            divide_row(m, piv, p - 1); // Previous pivot row, nobody reads it any more
+        }
+        if ((piv = choose_pivot(args, args->slots + (p % 2) * args->nthreads, &pivalue)) == -1)
+        {
+            return NULL; // Singular, every worker stops at the same pivot
+        }
+        if (piv >= args->start && piv < args->end)
+        {
+            args->used[piv] = 1;
+            m->perm[p] = piv;
+        }
+
+        for (row = args->start; row < args->end; row++)
+        {
+            if (row != piv) // Perform elimination on all except the current pivot row
+            {
+                multiplier = row_of(A, ld, row)[p] / pivalue;
+                simd->eliminate(row_of(A, ld, row), row_of(A, ld, piv), multiplier, N); // Elimination step on A
+                simd->eliminate(row_of(I, ld, row), row_of(I, ld, piv), multiplier, N); // Elimination step on I
+                row_of(A, ld, row)[p] = 0.0;
+            }
+        }
+        if (p + 1 < N)
+        {
+            propose_pivot(args, A, ld, p + 1, &args->slots[((p + 1) % 2) * args->nthreads + args->id]);
+        }
+        pthread_barrier_wait(args->barrier);
+    }
+    if (piv >= args->start && piv < args->end)
+    {
+        divide_row(m, piv, N - 1);
+    }
+    return NULL;
+}
+
+/*
+ * row += w[0] * R[0] + ... + w[k-1] * R[k-1], for the `n` columns of a
+ * tile. Four pivot rows per pass, so `row` is loaded and stored k/4 times.
+ */
+static void rank_k_row(const struct matinv_simd *simd, double *row, const double *w, const double *R,
+                       int k, size_t stride, int n)
+{
+    int q = 0;
+    for (; q + 4 <= k; q += 4)
+    {
+        const double *r0 = R + (size_t)q * stride;
+        simd->update4(row, w + q, r0, r0 + stride, r0 + 2 * stride, r0 + 3 * stride, n);
+    }
+    for (; q < k; q++)
+    {
+        simd->eliminate(row, R + (size_t)q * stride, -w[q], n);
+    }
+}
+
+// Blocked: divide panel row `row`, the pivot of column q, and give it its 1 in T
+static void divide_panel_row(double *pr, int q, int k)
+{
+    double pivalue = pr[q];
+    pr[k + q] = 1.0;
+    for (int col = 0; col < 2 * k; col++)
+        pr[col] /= pivalue;
+}
+
+/*
+ * Worker of the blocked (right-looking) Gauss-Jordan inversion.
+ *
+ * Eliminating pivots p0..p0+k-1 multiplies [A | I] from the left with a
+ * matrix T that differs from the identity only in the k columns of the
+ * pivot rows. So for each panel of k pivots:
+ *   1. run the pivoting algorithm on the N x k panel of A, with those k
+ *      columns of the identity next to it, which turn into the columns
+ *      of T. As the pivot rows are only known once chosen, a pivot row's
+ *      1 is put in when it is divided; until then the others use it as 1.
+ *   2. apply T to the rest as one rank-k update, [A | I] += W * R, where
+ *      W = T - identity (N x k) and R the k pivot rows before the panel.
+ * The update does the O(N^3) work, tiled so that a tile of R stays in
+ * cache while the worker's rows stream past it.
+ */
+static void *eliminate_blocked(void *params)
+{
+    struct threadArgs *args = (struct threadArgs *)params;
+    struct matinv *m = args->m;
+    int N = m->N;
+    double *A = m->A, *I = m->I;
+    size_t ld = m->ld;
+    double *P = args->P, *RA = args->RA, *RI = args->RI;
+    const struct matinv_simd *simd = m->simd;
+    double w[MATINV_BLOCK], pivalue;
+    int start = args->start, end = args->end;
+    size_t pstride = 2 * MATINV_BLOCK;
+
+    if (!gate_pass(args))
+        return NULL;
+    for (int p0 = 0; p0 < N; p0 += MATINV_BLOCK)
+    {
+        int k = (N - p0 < MATINV_BLOCK) ? N - p0 : MATINV_BLOCK;
+        int width = 2 * k; // Panel row: k columns of A, then k of T, at a fixed stride so rows stay put
+        int piv = -1;
+
+        // Load own panel rows. This barrier also keeps R until everyone is done with the last panel.
+        for (int row = start; row < end; row++)
+        {
+            double *pr = P + (size_t)row * pstride;
+            for (int q = 0; q < k; q++)
+            {
+                pr[q] = row_of(A, ld, row)[p0 + q];
+                pr[k + q] = 0.0;
+            }
+        }
+        propose_pivot(args, P, pstride, 0, &args->slots[(p0 % 2) * args->nthreads + args->id]);
+        pthread_barrier_wait(args->barrier);
+
+        // 1. Gauss-Jordan with partial pivoting on the panel, as in eliminate_rows()
+        for (int q = 0; q < k; q++)
+        {
+            int p = p0 + q;
+            if (piv >= start && piv < end)
+            {
+                divide_panel_row(P + (size_t)piv * pstride, q - 1, k);
+            }
+            if ((piv = choose_pivot(args, args->slots + (p % 2) * args->nthreads, &pivalue)) == -1)
+            {
+                return NULL;
+            }
+            if (piv >= start && piv < end)
+            {
+                args->used[piv] = 1;
+                m->perm[p] = piv;
+                // Save the pivot row, which the update needs unchanged
+                memcpy(row_of(RA, ld, q), row_of(A, ld, piv), N * sizeof(double));
+                memcpy(row_of(RI, ld, q), row_of(I, ld, piv), N * sizeof(double));
+            }
+
+            const double *pr = P + (size_t)piv * pstride;
+            for (int row = start; row < end; row++)
+            {
+                if (row == piv)
+                    continue;
+                double *r = P + (size_t)row * pstride;
+                double multiplier = r[q] / pivalue;
+                simd->eliminate(r, pr, multiplier, width);
+                r[q] = 0.0;
+                r[k + q] = -multiplier; // The pivot row's 1 in T
+            }
+            if (q + 1 < k)
+            {
+                propose_pivot(args, P, pstride, q + 1, &args->slots[((p + 1) % 2) * args->nthreads + args->id]);
+                pthread_barrier_wait(args->barrier);
+            }
+        }
+
+        // Wait until everyone is done with the last pivot row and R is complete
+        pthread_barrier_wait(args->barrier);
+        if (piv >= start && piv < end)
+        {
+            divide_panel_row(P + (size_t)piv * pstride, k - 1, k);
+        }
+
+        // 2. Rank-k update of own rows, one column tile at a time
+        for (int jj = 0; jj < N; jj += MATINV_TILE)
+        {
+            int n = (N - jj < MATINV_TILE) ? N - jj : MATINV_TILE;
+            for (int row = start; row < end; row++)
+            {
+                const double *pr = P + (size_t)row * pstride;
+                for (int q = 0; q < k; q++)
+                    w[q] = pr[k + q] - ((row == m->perm[p0 + q]) ? 1.0 : 0.0);
+                rank_k_row(simd, row_of(A, ld, row) + jj, w, RA + jj, k, ld, n);
+                rank_k_row(simd, row_of(I, ld, row) + jj, w, RI + jj, k, ld, n);
+            }
+        }
+
+        // The panel columns of A are exact
+        for (int row = start; row < end; row++)
+        {
+            for (int q = 0; q < k; q++)
+                row_of(A, ld, row)[p0 + q] = P[(size_t)row * pstride + q];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * M as a row-major matrix file (format in matinv_kern.h).
+ */
+static void write_binary(struct matinv *m, double *M, FILE *out)
+{
+    unsigned char hdr[MATINV_FILE_HDR] = {0};
+    memcpy(hdr, MATINV_FILE_MAGIC, 4);
+    put_le(hdr + 4, MATINV_FILE_VERSION, 4);
+    put_le(hdr + 8, m->N, 8);
+    put_le(hdr + 16, MATINV_F64, 4);
+    put_le(hdr + 20, MATINV_ROW_MAJOR, 4);
+    fwrite(hdr, 1, sizeof(hdr), out);
+
+    for (int row = 0; row < m->N; row++)
+    {
+        const double *x = matinv_row(m, M, row);
+        if (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+        {
+            fwrite(x, sizeof(double), m->N, out);
+            continue;
+        }
+        for (int col = 0; col < m->N; col++)
+        {
+            unsigned char le[sizeof(double)];
+            uint64_t bits;
+            memcpy(&bits, &x[col], sizeof(bits));
+            put_le(le, bits, sizeof(le));
+            fwrite(le, 1, sizeof(le), out);
+        }
+    }
+}
+
+/*
+ * M with every element exact, formatted into a line buffer and written a
+ * row at a time.
+ */
+static void write_exact(struct matinv *m, double *M, FILE *out)
+{
+    char *line = malloc((size_t)m->N * (FMT_DOUBLE_MAX + 1) + 2);
+    if (line == NULL)
+    {
+        fprintf(out, "Cannot allocate output buffer\n");
+        return;
+    }
+    for (int row = 0; row < m->N; row++)
+    {
+        const double *x = matinv_row(m, M, row);
+        char *p = line;
+        for (int col = 0; col < m->N; col++)
+        {
+            *p++ = ' ';
+            p += fmt_double(p, x[col]);
+        }
+        *p++ = '\n';
+        fwrite(line, 1, p - line, out);
+    }
+    free(line);
+}
+
+void matinv_print(struct matinv *m, double *M, char name[], FILE *out)
+{
+    int row, col;
+
+    if (m->format == MATINV_OUT_BINARY)
+    {
+        write_binary(m, M, out);
+        return;
+    }
+    fprintf(out, "%s Matrix:\n", name);
+    if (m->format == MATINV_OUT_EXACT)
+    {
+        write_exact(m, M, out);
+        fprintf(out, "\n\n");
+        return;
+    }
+    for (row = 0; row < m->N; row++)
+    {
+        for (col = 0; col < m->N; col++)
+            fprintf(out, " %5.2f", matinv_row(m, M, row)[col]);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "\n\n");
+}
+
+void matinv_free(struct matinv *m)
+{
+    if (m->A != NULL)
+        munmap(m->A, m->bytes);
+    if (m->I != NULL)
+        munmap(m->I, m->bytes);
+    free(m->perm);
+    free(m->check);
+    free(m->cpus);
+    m->cpus = NULL;
+    m->A = NULL;
+    m->I = NULL;
+    m->perm = NULL;
+    m->check = NULL;
+}
@@ -0,0 +1,206 @@
+/*
+ * Vectorized row operations of the matrix inverse (see matinv_simd.h).
+ *
+ * Every x86-64 CPU has SSE2, so that is the baseline the library is
+ * compiled for. The AVX2+FMA and AVX-512 versions are compiled with
+ * target attributes and only called after CPUID says the CPU has them,
+ * so one binary runs on every machine. Other architectures get the
+ * plain C loops.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/matinv_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MATINV_X86
+#endif
+
+static void eliminate_generic(double *restrict y, const double *restrict x, double a, int n)
+{
+    for (int j = 0; j < n; j++)
+        y[j] = y[j] - x[j] * a;
+}
+
+static void update4_generic(double *restrict y, const double w[4], const double *r0, const double *r1,
+                            const double *r2, const double *r3, int n)
+{
+    double w0 = w[0], w1 = w[1], w2 = w[2], w3 = w[3];
+    for (int j = 0; j < n; j++)
+        y[j] += w0 * r0[j] + w1 * r1[j] + w2 * r2[j] + w3 * r3[j];
+}
+
+static const struct matinv_simd simd_generic = {"generic", eliminate_generic, update4_generic};
+
+#ifdef MATINV_X86
+
+/* SSE2: 2 doubles per register, same rounding as the plain loops */
+
+static void eliminate_sse2(double *restrict y, const double *restrict x, double a, int n)
+{
+    __m128d va = _mm_set1_pd(a);
+    int j = 0;
+    for (; j + 4 <= n; j += 4)
+    {
+        __m128d y0 = _mm_sub_pd(_mm_loadu_pd(y + j), _mm_mul_pd(_mm_loadu_pd(x + j), va));
+        __m128d y1 = _mm_sub_pd(_mm_loadu_pd(y + j + 2), _mm_mul_pd(_mm_loadu_pd(x + j + 2), va));
+        _mm_storeu_pd(y + j, y0);
+        _mm_storeu_pd(y + j + 2, y1);
+    }
+    for (; j < n; j++)
+        y[j] = y[j] - x[j] * a;
+}
+
+static void update4_sse2(double *restrict y, const double w[4], const double *r0, const double *r1,
+                         const double *r2, const double *r3, int n)
+{
+    __m128d w0 = _mm_set1_pd(w[0]), w1 = _mm_set1_pd(w[1]);
+    __m128d w2 = _mm_set1_pd(w[2]), w3 = _mm_set1_pd(w[3]);
+    int j = 0;
+    for (; j + 2 <= n; j += 2)
+    {
+        __m128d s = _mm_add_pd(_mm_mul_pd(w0, _mm_loadu_pd(r0 + j)), _mm_mul_pd(w1, _mm_loadu_pd(r1 + j)));
+        s = _mm_add_pd(s, _mm_mul_pd(w2, _mm_loadu_pd(r2 + j)));
+        s = _mm_add_pd(s, _mm_mul_pd(w3, _mm_loadu_pd(r3 + j)));
+        _mm_storeu_pd(y + j, _mm_add_pd(_mm_loadu_pd(y + j), s));
+    }
+    for (; j < n; j++)
+        y[j] += w[0] * r0[j] + w[1] * r1[j] + w[2] * r2[j] + w[3] * r3[j];
+}
+
+static const struct matinv_simd simd_sse2 = {"sse2", eliminate_sse2, update4_sse2};
+
+/* AVX2 + FMA: 4 doubles per register, one rounding per multiply-add */
+
+__attribute__((target("avx2,fma"))) static void eliminate_avx2(double *restrict y, const double *restrict x,
+                                                               double a, int n)
+{
+    __m256d va = _mm256_set1_pd(a);
+    int j = 0;
+    for (; j + 8 <= n; j += 8)
+    {
+        __m256d y0 = _mm256_fnmadd_pd(_mm256_loadu_pd(x + j), va, _mm256_loadu_pd(y + j));
+        __m256d y1 = _mm256_fnmadd_pd(_mm256_loadu_pd(x + j + 4), va, _mm256_loadu_pd(y + j + 4));
+        _mm256_storeu_pd(y + j, y0);
+        _mm256_storeu_pd(y + j + 4, y1);
+    }
+    for (; j + 4 <= n; j += 4)
+        _mm256_storeu_pd(y + j, _mm256_fnmadd_pd(_mm256_loadu_pd(x + j), va, _mm256_loadu_pd(y + j)));
+    for (; j < n; j++)
+        y[j] = __builtin_fma(-x[j], a, y[j]);
+}
+
+__attribute__((target("avx2,fma"))) static void update4_avx2(double *restrict y, const double w[4],
+                                                             const double *r0, const double *r1,
+                                                             const double *r2, const double *r3, int n)
+{
+    __m256d w0 = _mm256_set1_pd(w[0]), w1 = _mm256_set1_pd(w[1]);
+    __m256d w2 = _mm256_set1_pd(w[2]), w3 = _mm256_set1_pd(w[3]);
+    int j = 0;
+    for (; j + 4 <= n; j += 4)
+    {
+        __m256d s = _mm256_loadu_pd(y + j);
+        s = _mm256_fmadd_pd(w0, _mm256_loadu_pd(r0 + j), s);
+        s = _mm256_fmadd_pd(w1, _mm256_loadu_pd(r1 + j), s);
+        s = _mm256_fmadd_pd(w2, _mm256_loadu_pd(r2 + j), s);
+        s = _mm256_fmadd_pd(w3, _mm256_loadu_pd(r3 + j), s);
+        _mm256_storeu_pd(y + j, s);
+    }
+    for (; j < n; j++)
+    {
+        double s = y[j];
+        s = __builtin_fma(w[0], r0[j], s);
+        s = __builtin_fma(w[1], r1[j], s);
+        s = __builtin_fma(w[2], r2[j], s);
+        y[j] = __builtin_fma(w[3], r3[j], s);
+    }
+}
+
+static const struct matinv_simd simd_avx2 = {"avx2", eliminate_avx2, update4_avx2};
+
+/* AVX-512: 8 doubles per register, the tail is done with a masked load and store */
+
+__attribute__((target("avx512f"))) static void eliminate_avx512(double *restrict y, const double *restrict x,
+                                                                double a, int n)
+{
+    __m512d va = _mm512_set1_pd(a);
+    int j = 0;
+    for (; j + 8 <= n; j += 8)
+        _mm512_storeu_pd(y + j, _mm512_fnmadd_pd(_mm512_loadu_pd(x + j), va, _mm512_loadu_pd(y + j)));
+    if (j < n)
+    {
+        __mmask8 k = (__mmask8)((1u << (n - j)) - 1);
+        __m512d t = _mm512_fnmadd_pd(_mm512_maskz_loadu_pd(k, x + j), va, _mm512_maskz_loadu_pd(k, y + j));
+        _mm512_mask_storeu_pd(y + j, k, t);
+    }
+}
+
+__attribute__((target("avx512f"))) static void update4_avx512(double *restrict y, const double w[4],
+                                                              const double *r0, const double *r1,
+                                                              const double *r2, const double *r3, int n)
+{
+    __m512d w0 = _mm512_set1_pd(w[0]), w1 = _mm512_set1_pd(w[1]);
+    __m512d w2 = _mm512_set1_pd(w[2]), w3 = _mm512_set1_pd(w[3]);
+    for (int j = 0; j < n; j += 8)
+    {
+        __mmask8 k = (n - j >= 8) ? 0xff : (__mmask8)((1u << (n - j)) - 1);
+        __m512d s = _mm512_maskz_loadu_pd(k, y + j);
+        s = _mm512_fmadd_pd(w0, _mm512_maskz_loadu_pd(k, r0 + j), s);
+        s = _mm512_fmadd_pd(w1, _mm512_maskz_loadu_pd(k, r1 + j), s);
+        s = _mm512_fmadd_pd(w2, _mm512_maskz_loadu_pd(k, r2 + j), s);
+        s = _mm512_fmadd_pd(w3, _mm512_maskz_loadu_pd(k, r3 + j), s);
+        _mm512_mask_storeu_pd(y + j, k, s);
+    }
+}
+
+static const struct matinv_simd simd_avx512 = {"avx512", eliminate_avx512, update4_avx512};
+
+#endif // MATINV_X86
+
+static const struct matinv_simd *chosen = &simd_generic;
+static pthread_once_t chosen_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Take the widest kernel the CPU supports. MATINV_SIMD=avx2 (or sse2,
+ * generic) in the environment caps it, for comparing the kernels.
+ */
+static void choose_simd(void)
+{
+#ifdef MATINV_X86
+    const char *cap = getenv("MATINV_SIMD");
+    const struct matinv_simd *order[] = {&simd_avx512, &simd_avx2, &simd_sse2};
+    int i = 0;
+
+    if (cap != NULL && strcmp(cap, "generic") == 0)
+        return;
+    if (cap != NULL)
+    {
+        while (i < 3 && strcmp(order[i]->name, cap) != 0)
+            i++;
+        if (i == 3) // Unknown name, no cap
+            i = 0;
+    }
+    __builtin_cpu_init();
+    for (; i < 3; i++)
+    {
+        if ((order[i] == &simd_avx512 && __builtin_cpu_supports("avx512f")) ||
+            (order[i] == &simd_avx2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) ||
+            (order[i] == &simd_sse2 && __builtin_cpu_supports("sse2")))
+        {
+            chosen = order[i];
+            return;
+        }
+    }
+#endif
+}
+
+/*
+ * The row operations for this CPU, chosen on the first call.
+ */
+const struct matinv_simd *matinv_simd(void)
+{
+    pthread_once(&chosen_once, choose_simd);
+    return chosen;
+}
@@ -10,21 +10,19 @@
 #include <string.h>
 #include <stdlib.h>
 
-#define MAX_SIZE 4096
-
-typedef double matrix[MAX_SIZE][MAX_SIZE];
+#define MAX_SIZE 65536
 
 int N;            /* matrix size		*/
 int maxnum;       /* max number of element*/
 char *Init;       /* matrix init type	*/
 int PRINT;        /* print switch		*/
-matrix A;         /* matrix A		*/
-matrix I = {0.0}; /* The A inverse matrix, which will be initialized to the identity matrix */
+double *A;        /* matrix A, N x N, row after row */
+double *I;        /* The A inverse matrix, which will be initialized to the identity matrix */
 
 /* forward declarations */
 void find_inverse(void);
 void Init_Matrix(void);
-void Print_Matrix(matrix M, char name[]);
+void Print_Matrix(double *M, char name[]);
 void Init_Default(void);
 int Read_Options(int, char **);
 
@@ -47,32 +45,32 @@ int main(int argc, char **argv)
 
 void find_inverse()
 {
-    int row, col, p; // 'p' stands for pivot (numbered from 0 to N-1)
+    long row, col, p; // 'p' stands for pivot (numbered from 0 to N-1), long so that row * N fits
     double pivalue;  // pivot value
 
     /* Bringing the matrix A to the identity form */
     for (p = 0; p < N; p++)
     { /* Outer loop */
-        pivalue = A[p][p];
+        pivalue = A[p * N + p];
         for (col = 0; col < N; col++)
         {
-            A[p][col] = A[p][col] / pivalue; /* Division step on A */
-            I[p][col] = I[p][col] / pivalue; /* Division step on I */
+            A[p * N + col] = A[p * N + col] / pivalue; /* Division step on A */
+            I[p * N + col] = I[p * N + col] / pivalue; /* Division step on I */
         }
-        assert(A[p][p] == 1.0);
+        assert(A[p * N + p] == 1.0);
 
         double multiplier;
         for (row = 0; row < N; row++)
         {
-            multiplier = A[row][p];
+            multiplier = A[row * N + p];
             if (row != p) // Perform elimination on all except the current pivot row
             {
                 for (col = 0; col < N; col++)
                 {
-                    A[row][col] = A[row][col] - A[p][col] * multiplier; /* Elimination step on A */
-                    I[row][col] = I[row][col] - I[p][col] * multiplier; /* Elimination step on I */
+                    A[row * N + col] = A[row * N + col] - A[p * N + col] * multiplier; /* Elimination step on A */
+                    I[row * N + col] = I[row * N + col] - I[p * N + col] * multiplier; /* Elimination step on I */
                 }
-                assert(A[row][p] == 0.0);
+                assert(A[row * N + p] == 0.0);
             }
         }
     }
@@ -80,7 +78,20 @@ void find_inverse()
 
 void Init_Matrix()
 {
-    int row, col;
+    long row, col;
+
+    if (N < 1 || N > MAX_SIZE)
+    {
+        printf("Matrix size must be between 1 and %d\n", MAX_SIZE);
+        exit(1);
+    }
+    A = calloc((size_t)N * N, sizeof(double));
+    I = calloc((size_t)N * N, sizeof(double));
+    if (A == NULL || I == NULL)
+    {
+        printf("Cannot allocate matrices\n");
+        exit(1);
+    }
 
     // Set the diagonal elements of the inverse matrix to 1.0
     // So that you get an identity matrix to begin with
@@ -89,7 +100,7 @@ void Init_Matrix()
         for (col = 0; col < N; col++)
         {
             if (row == col)
-                I[row][col] = 1.0;
+                I[row * N + col] = 1.0;
         }
     }
 
@@ -105,9 +116,9 @@ void Init_Matrix()
             for (col = 0; col < N; col++)
             {
                 if (row == col) /* diagonal dominance */
-                    A[row][col] = (double)(rand() % maxnum) + 5.0;
+                    A[row * N + col] = (double)(rand() % maxnum) + 5.0;
                 else
-                    A[row][col] = (double)(rand() % maxnum) + 1.0;
+                    A[row * N + col] = (double)(rand() % maxnum) + 1.0;
             }
         }
     }
@@ -118,9 +129,9 @@ void Init_Matrix()
             for (col = 0; col < N; col++)
             {
                 if (row == col) /* diagonal dominance */
-                    A[row][col] = 5.0;
+                    A[row * N + col] = 5.0;
                 else
-                    A[row][col] = 2.0;
+                    A[row * N + col] = 2.0;
             }
         }
     }
@@ -133,15 +144,15 @@ void Init_Matrix()
     }
 }
 
-void Print_Matrix(matrix M, char name[])
+void Print_Matrix(double *M, char name[])
 {
-    int row, col;
+    long row, col;
 
     printf("%s Matrix:\n", name);
     for (row = 0; row < N; row++)
     {
         for (col = 0; col < N; col++)
-            printf(" %5.2f", M[row][col]);
+            printf(" %5.2f", M[row * N + col]);
         printf("\n");
     }
     printf("\n\n");
@@ -0,0 +1,179 @@
+/*
+ * Thread pinning and NUMA memory placement (see numa_util.h).
+ *
+ * Linux puts a page on the node of the CPU that first writes it. The
+ * kernels use that: with a CPU list, each worker is pinned and touches
+ * its own rows first, so the rows it works on are in its node's memory.
+ * numa_report() shows where the pages ended up, through move_pages(2)
+ * called in query mode, so libnuma is not needed.
+ */
+
+#define _GNU_SOURCE // cpu_set_t, pthread_setaffinity_np
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "../include/numa_util.h"
+
+/*
+ * Parse a CPU list like "0-3,8,10-11" into a malloc'd array `*cpus`, in
+ * the order given. Returns the number of CPUs, or -1 if the list is
+ * malformed or names a CPU this process may not run on.
+ */
+int cpulist_parse(const char *list, int **cpus)
+{
+    int n = 0, cap = 16, bad = 0;
+    int *out = malloc(cap * sizeof(int));
+    const char *p = list;
+    cpu_set_t allowed;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+        CPU_ZERO(&allowed);
+
+    while (out != NULL && *p != '\0' && !bad)
+    {
+        char *end;
+        long first = strtol(p, &end, 10), last;
+        if (end == p || first < 0)
+        {
+            bad = 1;
+            break;
+        }
+        last = first;
+        p = end;
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first)
+            {
+                bad = 1;
+                break;
+            }
+            p = end;
+        }
+        if (last >= NUMA_MAX_CPUS)
+        {
+            bad = 1;
+            break;
+        }
+        for (long cpu = first; cpu <= last && !bad; cpu++)
+        {
+            if (!CPU_ISSET(cpu, &allowed))
+            {
+                bad = 1;
+                break;
+            }
+            if (n == cap)
+            {
+                int *grown = realloc(out, (cap *= 2) * sizeof(int));
+                if (grown == NULL)
+                {
+                    free(out);
+                    return -1;
+                }
+                out = grown;
+            }
+            out[n++] = cpu;
+        }
+        if (*p == ',')
+            p++;
+        else if (*p != '\0')
+            bad = 1;
+    }
+    if (out == NULL || bad || n == 0)
+    {
+        free(out);
+        return -1;
+    }
+    *cpus = out;
+    return n;
+}
+
+// Threads created with `attr` run on `cpu` only
+int pin_attr(pthread_attr_t *attr, int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+/*
+ * Run the calling thread on `cpu` only, saving its affinity in `saved`
+ * for unpin_self(): the caller may be a server thread that is reused.
+ */
+int pin_self(int cpu, cpu_set_t *saved)
+{
+    cpu_set_t set;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(*saved), saved) != 0)
+        return -1;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+void unpin_self(const cpu_set_t *saved)
+{
+    pthread_setaffinity_np(pthread_self(), sizeof(*saved), saved);
+}
+
+/*
+ * Report on which nodes the `bytes` at `addr` are, as a share of their
+ * pages, e.g. "A memory  = node0 50%, node1 50%". Large areas are
+ * sampled at NUMA_SAMPLE_PAGES evenly spaced pages.
+ */
+void numa_report(FILE *out, const char *name, const void *addr, size_t bytes)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t first = (uintptr_t)addr / page * page;
+    size_t pages = ((uintptr_t)addr + bytes - first + page - 1) / page;
+    size_t step = (pages + NUMA_SAMPLE_PAGES - 1) / NUMA_SAMPLE_PAGES;
+    size_t count = (step > 0) ? (pages + step - 1) / step : 0;
+    void **where = malloc((count + 1) * sizeof(void *));
+    int *status = malloc((count + 1) * sizeof(int));
+    size_t on[NUMA_MAX_NODES] = {0}, absent = 0;
+
+    fprintf(out, "%-10s= ", name);
+    if (count == 0 || where == NULL || status == NULL)
+    {
+        fprintf(out, "unknown \n");
+        free(where);
+        free(status);
+        return;
+    }
+    for (size_t i = 0; i < count; i++)
+        where[i] = (void *)(first + i * step * page);
+
+    if (syscall(SYS_move_pages, 0, count, where, NULL, status, 0) == -1)
+    {
+        fprintf(out, "unknown (%s) \n", strerror(errno));
+        free(where);
+        free(status);
+        return;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (status[i] >= 0 && status[i] < NUMA_MAX_NODES)
+            on[status[i]]++;
+        else
+            absent++; // Not faulted in yet (-ENOENT)
+    }
+
+    const char *sep = "";
+    for (int node = 0; node < NUMA_MAX_NODES; node++)
+    {
+        if (on[node] > 0)
+        {
+            fprintf(out, "%snode%d %.0f%%", sep, node, 100.0 * on[node] / count);
+            sep = ", ";
+        }
+    }
+    if (absent > 0)
+        fprintf(out, "%suntouched %.0f%%", sep, 100.0 * absent / count);
+    fprintf(out, " \n");
+    free(where);
+    free(status);
+}
@@ -0,0 +1,148 @@
+/*
+ * A fixed pool of worker threads taking jobs from a FIFO queue.
+ * Finished jobs are collected on a done list and announced on an eventfd,
+ * so an event loop can wait for sockets and job completions at the same time.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "../include/pool_util.h"
+
+static void *pool_worker(void *params)
+{
+    struct pool *pool = (struct pool *)params;
+    struct job *job;
+    uint64_t one = 1;
+
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->head == NULL && !pool->stop)
+        {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->stop)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL)
+        {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        job->run(job);
+
+        pthread_mutex_lock(&pool->lock);
+        job->next = pool->done;
+        pool->done = job;
+        pthread_mutex_unlock(&pool->lock);
+
+        // Wake up the event loop
+        if (write(pool->event_fd, &one, sizeof(one)) != sizeof(one))
+        {
+            perror("pool: eventfd write");
+        }
+    }
+}
+
+/*
+ * Start `nthreads` workers. If `nthreads` < 1, use one worker per online CPU.
+ */
+void pool_init(struct pool *pool, int nthreads)
+{
+    if (nthreads < 1)
+    {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads < 1)
+            nthreads = 1;
+    }
+
+    pool->nthreads = nthreads;
+    pool->head = pool->tail = pool->done = NULL;
+    pool->stop = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    pool->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->event_fd == -1)
+    {
+        perror("pool: eventfd");
+        exit(EXIT_FAILURE);
+    }
+
+    pool->threads = malloc(nthreads * sizeof(pthread_t));
+    for (int i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0)
+        {
+            perror("pool: pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Queue a job. Never blocks on the job itself.
+ */
+void pool_submit(struct pool *pool, struct job *job)
+{
+    job->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail == NULL)
+    {
+        pool->head = pool->tail = job;
+    }
+    else
+    {
+        pool->tail->next = job;
+        pool->tail = job;
+    }
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Detach and return the list of finished jobs (linked through `next`).
+ * Also resets the eventfd counter.
+ */
+struct job *pool_take_done(struct pool *pool)
+{
+    uint64_t count;
+    struct job *done;
+
+    while (read(pool->event_fd, &count, sizeof(count)) == sizeof(count))
+        ;
+
+    pthread_mutex_lock(&pool->lock);
+    done = pool->done;
+    pool->done = NULL;
+    pthread_mutex_unlock(&pool->lock);
+    return done;
+}
+
+/*
+ * Stop and join all workers. Queued jobs that never started are dropped.
+ */
+void pool_destroy(struct pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->nthreads; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    close(pool->event_fd);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+}
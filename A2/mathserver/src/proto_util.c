@@ -0,0 +1,201 @@
+/*
+ * Binary framing for client.c and server.c (see proto_util.h).
+ * Blocking helpers; the multiplexing strategies parse frames themselves in conn_util.c.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "../include/file_util.h"
+#include "../include/proto_util.h"
+
+void frame_pack(char buf[FRAME_HDR_SIZE], struct frame_hdr *hdr)
+{
+    uint16_t magic = htobe16(PROTO_MAGIC);
+    uint32_t job_id = htobe32(hdr->job_id);
+    uint32_t payload_len = htobe32(hdr->payload_len);
+    uint32_t flags = htobe32(hdr->flags);
+    uint64_t size = htobe64(hdr->size);
+
+    memcpy(buf, &magic, 2);
+    buf[2] = PROTO_VERSION;
+    buf[3] = hdr->opcode;
+    memcpy(buf + 4, &job_id, 4);
+    memcpy(buf + 8, &payload_len, 4);
+    memcpy(buf + 12, &flags, 4);
+    memcpy(buf + 16, &size, 8);
+}
+
+/*
+ * Decode a header. Returns -1 if it is not a frame of a version we speak.
+ */
+int frame_unpack(const char buf[FRAME_HDR_SIZE], struct frame_hdr *hdr)
+{
+    uint16_t magic;
+    uint32_t job_id, payload_len, flags;
+    uint64_t size;
+
+    memcpy(&magic, buf, 2);
+    memcpy(&job_id, buf + 4, 4);
+    memcpy(&payload_len, buf + 8, 4);
+    memcpy(&flags, buf + 12, 4);
+    memcpy(&size, buf + 16, 8);
+
+    hdr->version = buf[2];
+    hdr->opcode = buf[3];
+    hdr->job_id = be32toh(job_id);
+    hdr->payload_len = be32toh(payload_len);
+    hdr->flags = be32toh(flags);
+    hdr->size = be64toh(size);
+
+    if (be16toh(magic) != PROTO_MAGIC || hdr->version != PROTO_VERSION)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Send all `len` bytes, however many send() calls it takes.
+ */
+int send_all(int sd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = send(sd, p, len, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Receive exactly `len` bytes. Returns -1 on errors or if the peer closes first.
+ */
+int recv_all(int sd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = recv(sd, p, len, 0);
+        if (n == 0)
+            return -1;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Send a frame. If `data` is NULL, only the header and payload are sent and
+ * the caller streams the `size` bytes of data itself.
+ */
+int send_frame(int sd, int opcode, uint32_t job_id, const char *payload, uint32_t payload_len,
+               const char *data, uint64_t size)
+{
+    char buf[FRAME_HDR_SIZE];
+    struct frame_hdr hdr = {PROTO_VERSION, opcode, job_id, payload_len, 0, size};
+    frame_pack(buf, &hdr);
+
+    // Header, payload and data leave in a single system call when the socket buffer allows
+    struct iovec iov[3] = {
+        {buf, FRAME_HDR_SIZE},
+        {(void *)payload, payload_len},
+        {(void *)data, data ? size : 0}};
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+
+    while (msg.msg_iovlen > 0)
+    {
+        ssize_t n = sendmsg(sd, &msg, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        // Skip what was sent
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len)
+        {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Receive a frame header and its payload into `payload` (NUL-terminated).
+ * The data that follows is left in the socket. Returns -1 on errors, on
+ * end of stream and on frames whose payload does not fit.
+ */
+int recv_frame(int sd, struct frame_hdr *hdr, char payload[], size_t payload_max)
+{
+    char buf[FRAME_HDR_SIZE];
+    if (recv_all(sd, buf, FRAME_HDR_SIZE) == -1)
+    {
+        return -1;
+    }
+    if (frame_unpack(buf, hdr) == -1 || hdr->payload_len >= payload_max)
+    {
+        fprintf(stderr, "Invalid frame\n");
+        return -1;
+    }
+    if (recv_all(sd, payload, hdr->payload_len) == -1)
+    {
+        return -1;
+    }
+    payload[hdr->payload_len] = '\0';
+    return 0;
+}
+
+/*
+ * Copy `size` bytes of frame data from socket `sd` to file descriptor `fd`,
+ * or discard them if `fd` is -1.
+ */
+int recv_to_fd(int sd, int fd, uint64_t size)
+{
+    char buf[CHUNK_SIZE];
+    while (size > 0)
+    {
+        ssize_t n = recv(sd, buf, size < sizeof(buf) ? size : sizeof(buf), 0);
+        if (n == 0)
+            return -1;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (fd != -1 && write(fd, buf, n) != n)
+        {
+            return -1;
+        }
+        size -= n;
+    }
+    return 0;
+}
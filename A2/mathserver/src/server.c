@@ -7,7 +7,7 @@
 #include "../include/server_util.h"
 
 // Default values
-int d = 0, port = -1;
+int d = 0, port = -1, workers = 0, text = 0;
 enum Strategy strat = FORK;
 
 // Declaring the command globally because most likely all of the functions will use this.
@@ -30,6 +30,9 @@ int main(int argc, char *argv[])
         run_as_daemon("server");
     }
 
+    // The log goes to a file more often than not; keep it current
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
     // Ignore signals
     signal(SIGPIPE, SIG_IGN);
     signal(SIGCHLD, SIG_IGN);
@@ -37,13 +40,13 @@ int main(int argc, char *argv[])
     switch (strat)
     {
     case FORK:
-        run_with_fork(port, cwd);
+        run_with_fork(port, cwd, !text);
         break;
     case MUXBASIC:
-        run_with_muxbasic(port, cwd);
+        run_with_muxbasic(port, cwd, !text);
         break;
     case MUXSCALE:
-        run_with_muxscale();
+        run_with_muxscale(port, cwd, workers, !text);
         break;
     }
 
@@ -95,6 +98,14 @@ void read_options(int argc, char *argv[])
                 // i++;
                 break;
 
+            case 'w':
+                workers = atoi(argv[++i]);
+                break;
+
+            case 't':
+                text = 1;
+                break;
+
             case 'h':
             case 'u':
                 usage();
@@ -122,5 +133,7 @@ void usage()
     printf("\nUsage: server [-p port]\n");
     printf("              [-d]            run as daemon\n");
     printf("              [-s strategy]   specify the request handling strategy (fork/muxbasic/muxscale)\n");
+    printf("              [-w workers]    compute workers for muxscale (default: one per CPU)\n");
+    printf("              [-t]            use the old text protocol\n");
     printf("              [-h]            help\n");
 }
@@ -3,13 +3,17 @@
  * with process strategies (e.g. forking), and/or running as daemon.
  */
 
+#define _GNU_SOURCE // accept4
+
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
@@ -18,105 +22,249 @@
 #include <sys/poll.h>
 #include <sys/types.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 #include "../include/server_util.h"
 #include "../include/file_util.h"
+#include "../include/kmeans_kern.h"
+#include "../include/matinv_kern.h"
+#include "../include/conn_util.h"
+#include "../include/pool_util.h"
+#include "../include/proto_util.h"
 
 /*
- * Execute kmeans
+ * Split `command` into whitespace separated arguments, at most `max` - 1.
+ * The arguments point into `copy`, which must hold PATH_SIZE bytes.
  */
-void kmeans_run(int sd, char command[], char cwd[], int client_num, int solution_num)
+static int split_command(char command[], char copy[], char *argv[], int max)
 {
-    // Path to directory for client results
-    char path[PATH_SIZE];
-    snprintf(path, PATH_SIZE, "%s/../computed_results/client%d/", cwd, client_num);
+    int argc = 0;
+    char *save;
+    snprintf(copy, PATH_SIZE, "%s", command);
 
-    // Create client dir if not exist
-    struct stat st = {0};
-    if (stat(path, &st) == -1)
+    char *ptr = strtok_r(copy, " \t\r\n", &save);
+    while (ptr != NULL && argc < max - 1)
     {
-        mkdir(path, 0777);
+        argv[argc++] = ptr;
+        ptr = strtok_r(NULL, " \t\r\n", &save);
     }
+    argv[argc] = NULL;
+    return argc;
+}
 
-    // Get input file if necessary
-    int inp = has_f_flag(command);
-    if (inp == 1)
+/*
+ * Run kmeans `command` in-process on the uploaded `input` (`input_len` bytes),
+ * or on the default data file if `input` is NULL.
+ * Returns the results in a malloc'd buffer of `*result_len` bytes.
+ */
+char *kmeans_exec(char command[], char cwd[], char *input, size_t input_len, size_t *result_len)
+{
+    char copy[PATH_SIZE], path[PATH_SIZE];
+    char *argv[MAX_ARGS];
+    char *result = NULL;
+    struct kmeans_options opt;
+    struct kmeans km = {0};
+    int argc = split_command(command, copy, argv, MAX_ARGS);
+
+    FILE *out = open_memstream(&result, result_len);
+    if (out == NULL)
     {
-        char input_path[PATH_SIZE];
-        snprintf(input_path, PATH_SIZE, "%s/input.txt", path);
-        recv_file(sd, input_path);
-        strncat(command, " -f ", PATH_SIZE - strlen(command));
-        strncat(command, input_path, PATH_SIZE - strlen(command));
+        perror("Cannot create result buffer");
+        *result_len = 0;
+        return NULL;
     }
 
-    // Concat path with results filename
-    char solution_str[20];
-    snprintf(solution_str, sizeof(solution_str), "/%d.txt", solution_num);
-    strncat(path, solution_str, PATH_SIZE - strlen(path));
+    kmeans_default_options(&opt);
+    if (kmeans_read_options(&opt, argc, argv) == -1)
+    {
+        fprintf(out, "Error: kmeans option missing its value\n");
+        fclose(out);
+        return result;
+    }
 
-    // Concat path command to the command.
-    strncat(command, " -p ", PATH_SIZE - strlen(command));
-    strncat(command, path, PATH_SIZE - strlen(command));
+    // Never read a path sent by the client, only what it uploaded
+    int rc;
+    if (opt.batch > 0)
+    {
+        // Mini-batches of the upload or the default file, the results written as they are computed
+        int fd = -1;
+        if (!has_f_flag(command))
+        {
+            snprintf(path, PATH_SIZE, "%s/src/kmeans-data.txt", cwd);
+            fd = open(path, O_RDONLY);
+        }
+        if ((fd == -1 && (input == NULL || !has_f_flag(command))) ||
+            kmeans_stream(&km, fd, input, input_len, &opt, out) == -1)
+        {
+            fprintf(out, "Error: no kmeans input data\n");
+        }
+        if (fd != -1)
+            close(fd);
+        kmeans_free(&km);
+        fclose(out);
+        return result;
+    }
+    if (has_f_flag(command))
+    {
+        rc = (input != NULL) ? kmeans_load(&km, input, input_len, opt.k) : -1;
+    }
+    else
+    {
+        snprintf(path, PATH_SIZE, "%s/src/kmeans-data.txt", cwd);
+        rc = kmeans_load_file(&km, path, opt.k);
+    }
 
-    // Execute kmeans
-    FILE *fp = popen(command, "r");
-    if (fp == NULL)
+    if (rc == -1)
     {
-        perror("Cannot start program");
-        exit(EXIT_FAILURE);
+        fprintf(out, "Error: no kmeans input data\n");
+    }
+    else if (opt.cpus != NULL && kmeans_place(&km, opt.cpus, NULL) == -1)
+    {
+        fprintf(out, "Error: bad CPU list %s\n", opt.cpus);
+    }
+    else
+    {
+        kmeans_seed(&km, opt.init); // The random centroids stay if memory is short
+        km.algorithm = opt.algorithm;
+        km.tol = opt.tol;
+        km.max_iter = opt.max_iter; // --trace is not written, the server never writes client paths
+        if (kmeans_cluster(&km) == -1)
+        {
+            fprintf(out, "Error: cannot cluster: %s\n", strerror(errno));
+        }
+        else
+        {
+            kmeans_write(&km, out, opt.assignments);
+        }
     }
-    pclose(fp); // pclose will block until the process opened by popen terminates.
-    send_file(sd, path);
+    kmeans_free(&km);
+    fclose(out);
+    return result;
 }
 
 /*
- * Execute matinv
+ * Run matinv `command` in-process, on the uploaded matrix file `input`
+ * (`input_len` bytes) if not NULL.
+ * Returns its report in a malloc'd buffer of `*result_len` bytes. With
+ * -O binary, that is only the inverse as a matrix file, or the report
+ * if there is no inverse.
  */
-void matinv_run(int sd, char command[], char cwd[], int client_num, int solution_num)
+char *matinv_exec(char command[], char *input, size_t input_len, size_t *result_len)
 {
-    // Path to directory for client results
-    char path[PATH_SIZE];
-    snprintf(path, PATH_SIZE, "%s/../computed_results/client%d/", cwd, client_num);
+    char copy[PATH_SIZE];
+    char *argv[MAX_ARGS];
+    char *result = NULL, *log_buf = NULL;
+    size_t log_len = 0;
+    struct matinv_options opt;
+    struct matinv m;
+    int argc = split_command(command, copy, argv, MAX_ARGS);
 
-    // Create client dir if not exist
-    struct stat st = {0};
-    if (stat(path, &st) == -1)
+    FILE *out = open_memstream(&result, result_len);
+    if (out == NULL)
     {
-        mkdir(path, 0777);
+        perror("Cannot create result buffer");
+        *result_len = 0;
+        return NULL;
     }
 
-    // Concat path with results filename
-    char solution_str[20];
-    snprintf(solution_str, sizeof(solution_str), "%d.txt", solution_num);
-    strncat(path, solution_str, PATH_SIZE - strlen(path));
-    strncat(command, " -p ", PATH_SIZE - strlen(command));
-    strncat(command, path, PATH_SIZE - strlen(command));
+    matinv_default_options(&opt);
+    if (matinv_read_options(&opt, argc, argv, out) != 0)
+    {
+        fclose(out);
+        return result;
+    }
 
-    // Execute matinv
-    FILE *fp = popen(command, "r");
-    if (fp == NULL)
+    FILE *log = out;
+    if (opt.format == MATINV_OUT_BINARY && (log = open_memstream(&log_buf, &log_len)) == NULL)
     {
-        perror("Cannot start program");
-        exit(EXIT_FAILURE);
+        log = out;
     }
 
-    // Save generated output to a results file
-    FILE *result_fp = fopen(path, "w");
-    if (result_fp == NULL)
+    // Never read a path sent by the client, only what it uploaded
+    int rc;
+    if (opt.input_path == NULL)
     {
-        perror("Error creating matinv results file");
-        exit(EXIT_FAILURE);
+        rc = matinv_init(&m, &opt, log);
+    }
+    else if (input != NULL)
+    {
+        rc = matinv_load(&m, &opt, input, input_len, log);
+    }
+    else
+    {
+        fprintf(log, "Error: no matinv input data\n");
+        rc = -1;
     }
 
-    // Send results file to client
-    char buf[BUF_SIZE];
-    while (fgets(buf, BUF_SIZE, fp) != NULL)
+    if (rc == 0)
     {
-        fprintf(result_fp, "%s", buf);
+        matinv_invert(&m);
+        if (matinv_report(&m, &opt, log) == 0 && opt.PRINT == 1)
+        {
+            matinv_print(&m, m.I, "Inversed", out);
+        }
+        matinv_free(&m);
+    }
+    if (log != out)
+    {
+        fclose(log);
+        if (ftell(out) == 0)
+        {
+            fwrite(log_buf, 1, log_len, out);
+        }
+        free(log_buf);
+    }
+    fclose(out);
+    return result;
+}
+
+/*
+ * Execute kmeans
+ */
+void kmeans_run(int sd, char command[], char cwd[])
+{
+    char *input = NULL, *result;
+    size_t input_len = 0, result_len;
+
+    // Get input file if necessary
+    if (has_f_flag(command))
+    {
+        input = recv_data(sd, &input_len);
+    }
+
+    result = kmeans_exec(command, cwd, input, input_len, &result_len);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    send_data(sd, result, result_len);
+    log_transfer("kmeans result", result_len, &start);
+    free(input);
+    free(result);
+}
+
+/*
+ * Execute matinv
+ */
+void matinv_run(int sd, char command[])
+{
+    char *input = NULL, *result;
+    size_t input_len = 0, result_len;
+
+    // Get input file if necessary
+    if (has_f_flag(command))
+    {
+        input = recv_data(sd, &input_len);
     }
-    fclose(result_fp);
-    pclose(fp);
-    send_file(sd, path);
+
+    result = matinv_exec(command, input, input_len, &result_len);
+
+    // Send results to client
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    send_data(sd, result, result_len);
+    log_transfer("matinv result", result_len, &start);
+    free(input);
+    free(result);
 }
 
 /*
@@ -204,18 +352,28 @@ void run_as_daemon(const char *process_name)
 }
 
 /*
- * Handle concurrent clients by forking the server process.
+ * Create a socket listening on `port`. The backlog is SOMAXCONN so that bursts
+ * of connects are queued by the kernel instead of refused.
  */
-void run_with_fork(int port, char cwd[])
+static int open_listener(int port, int nonblocking)
 {
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0), 0);
     if (server_socket == -1)
     {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
 
+    // Sets socket to be reusable
+    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on)) < 0)
+    {
+        perror("Set socket options failed");
+        exit(EXIT_FAILURE);
+    }
+
     struct sockaddr_in server_address;
+    memset(&server_address, 0, sizeof(server_address));
     server_address.sin_family = AF_INET;
     server_address.sin_port = htons(port);
     server_address.sin_addr.s_addr = INADDR_ANY;
@@ -226,11 +384,156 @@ void run_with_fork(int port, char cwd[])
         exit(EXIT_FAILURE);
     }
 
-    if ((listen(server_socket, 1)) != 0)
+    if ((listen(server_socket, SOMAXCONN)) != 0)
     {
         perror("Listen to socket failed.");
         exit(EXIT_FAILURE);
     }
+    return server_socket;
+}
+
+/*
+ * Fork, binary protocol: every request of the client runs on its own thread
+ * and answers as soon as it is done. Only used in the per-client child.
+ */
+struct fork_job
+{
+    int sd;
+    uint32_t job_id;
+    char cmd[7];
+    char command[PATH_SIZE];
+    char solution[32];
+    char *cwd;
+    char *input;
+    size_t input_len;
+};
+
+static pthread_mutex_t fork_lock = PTHREAD_MUTEX_INITIALIZER; // Serializes frames on the socket
+static pthread_cond_t fork_answered = PTHREAD_COND_INITIALIZER;
+static int fork_running = 0;
+
+static void *fork_job_run(void *arg)
+{
+    struct fork_job *job = arg;
+    char *result;
+    size_t result_len = 0;
+
+    if (strcmp(job->cmd, "kmeans") == 0)
+    {
+        result = kmeans_exec(job->command, job->cwd, job->input, job->input_len, &result_len);
+    }
+    else
+    {
+        result = matinv_exec(job->command, job->input, job->input_len, &result_len);
+    }
+
+    pthread_mutex_lock(&fork_lock);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (send_frame(job->sd, OP_RESULT, job->job_id, job->solution, strlen(job->solution), result, result_len) == 0)
+    {
+        log_transfer(job->solution, result_len, &start);
+    }
+    fork_running--;
+    pthread_cond_signal(&fork_answered);
+    pthread_mutex_unlock(&fork_lock);
+
+    free(result);
+    free(job->input);
+    free(job);
+    return NULL;
+}
+
+/*
+ * Serve one client speaking the binary protocol (proto_util.h). Requests are
+ * read while earlier ones run, at most MAX_PIPELINE at a time.
+ */
+static void serve_binary(int sd, int client_num, char cwd[])
+{
+    int solution_num = 0;
+    char command[PATH_SIZE];
+    struct frame_hdr hdr;
+
+    while (recv_frame(sd, &hdr, command, PATH_SIZE) == 0 && hdr.opcode == OP_CMD)
+    {
+        if (hdr.size > MAX_UPLOAD)
+        {
+            char error[] = "Error! Input file too large";
+            pthread_mutex_lock(&fork_lock);
+            send_frame(sd, OP_ERROR, hdr.job_id, error, strlen(error), NULL, 0);
+            pthread_mutex_unlock(&fork_lock);
+            if (recv_to_fd(sd, -1, hdr.size) == -1)
+            {
+                break;
+            }
+            continue;
+        }
+        struct fork_job *job = calloc(1, sizeof(struct fork_job));
+        if (job == NULL || (hdr.size > 0 && (job->input = malloc(hdr.size + 1)) == NULL) ||
+            recv_all(sd, job->input, hdr.size) == -1)
+        {
+            break;
+        }
+        job->sd = sd;
+        job->job_id = hdr.job_id;
+        job->cwd = cwd;
+        job->input_len = hdr.size;
+        snprintf(job->command, PATH_SIZE, "%s", command);
+        snprintf(job->cmd, sizeof(job->cmd), "%.6s", command);
+        printf("Client %d commanded: %s\n", client_num, command);
+
+        pthread_mutex_lock(&fork_lock);
+        if (strcmp(job->cmd, "matinv") != 0 && strcmp(job->cmd, "kmeans") != 0)
+        {
+            char error[] = "Error! Valid commands: 'matinv' or 'kmeans'";
+            send_frame(sd, OP_ERROR, hdr.job_id, error, strlen(error), NULL, 0);
+            pthread_mutex_unlock(&fork_lock);
+            free(job->input);
+            free(job);
+            continue;
+        }
+
+        // Generate solution filename
+        snprintf(job->solution, sizeof(job->solution), "%s_client%d_soln%d.txt", job->cmd, client_num, ++solution_num);
+        printf("Sending solution: %s\n", job->solution);
+
+        while (fork_running >= MAX_PIPELINE)
+        {
+            pthread_cond_wait(&fork_answered, &fork_lock);
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, fork_job_run, job) != 0)
+        {
+            perror("Cannot start job");
+            char error[] = "Error! Cannot start the job";
+            send_frame(sd, OP_ERROR, hdr.job_id, error, strlen(error), NULL, 0);
+            pthread_mutex_unlock(&fork_lock);
+            free(job->input);
+            free(job);
+            continue;
+        }
+        pthread_detach(thread);
+        fork_running++;
+        pthread_mutex_unlock(&fork_lock);
+    }
+
+    // Client done, answer what is still running
+    pthread_mutex_lock(&fork_lock);
+    while (fork_running > 0)
+    {
+        pthread_cond_wait(&fork_answered, &fork_lock);
+    }
+    pthread_mutex_unlock(&fork_lock);
+    close(sd);
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * Handle concurrent clients by forking the server process.
+ */
+void run_with_fork(int port, char cwd[], int binary)
+{
+    int server_socket = open_listener(port, 0);
     printf("Listening for clients...\n");
 
     int client_num = 0, solution_num = 0;
@@ -244,18 +547,23 @@ void run_with_fork(int port, char cwd[])
         {
             printf("Connected with client %d\n", client_num);
             solution_num = 0;
+            if (binary)
+            {
+                serve_binary(client_socket, client_num, cwd);
+            }
 
             while (1)
             {
                 solution_num++;
                 char msg[BUF_SIZE];
-                int err = recv(client_socket, msg, sizeof(msg), 0);
-                if (err < 1)
+                // The command frame is always BUF_SIZE bytes, however TCP splits or merges it
+                if (recv_all(client_socket, msg, BUF_SIZE) == -1)
                 {
                     // Client done
                     close(client_socket);
                     exit(EXIT_SUCCESS);
                 }
+                msg[BUF_SIZE - 1] = '\0';
 
                 char cmd[7]; // "kmeans" or "matinv"
                 snprintf(cmd, sizeof(cmd), "%.6s", msg);
@@ -283,259 +591,505 @@ void run_with_fork(int port, char cwd[])
                 }
 
                 // Run kmeans_run or matinv_run based on msg.
-                char command[PATH_SIZE];
-                snprintf(command, PATH_SIZE, "%s/%s", cwd, msg);
                 if (strcmp(cmd, "kmeans") == 0)
                 {
-                    kmeans_run(client_socket, command, cwd, client_num, solution_num);
+                    kmeans_run(client_socket, msg, cwd);
                 }
                 else if (strcmp(cmd, "matinv") == 0)
                 {
-                    matinv_run(client_socket, command, cwd, client_num, solution_num);
+                    matinv_run(client_socket, msg);
                 }
             }
         }
+        close(client_socket); // The child owns the connection
     }
 }
 
 /*
- * Muxbasic (poll)
- * Source: IBM, <https://www.ibm.com/docs/en/i/7.2?topic=designs-using-poll-instead-select>
+ * Raise the soft limit on open descriptors to the hard limit, so that
+ * thousands of client sockets can be open at once.
  */
-void run_with_muxbasic(int port, char cwd[])
+static void raise_fd_limit()
 {
-    printf("Muxbasic not implemented\n");
-    exit(EXIT_NOT_IMPLEMENTED);
-
-    /*
-    int len, rc, on = 1;
-    int listen_sock = -1;
-    int new_sock = -1;
-    int desc_ready, end_server = 0, compress_array = 0;
-    int close_conn;
-    char buffer[80];
-    struct sockaddr_in addr;
-    int timeout;
-    struct pollfd fds[200];
-    int nfds = 1, current_size = 0, i, j;
-    int client_num = 0;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/*
+ * The muxbasic poll set. Besides the listening socket it holds client
+ * sockets and the output pipes of jobs; `slots[i]` tells what `fds[i]` is.
+ * Grows by doubling, entries are removed by moving the last one into the hole.
+ */
+struct mux_slot
+{
+    struct conn *conn;   // NULL for the listening socket
+    struct request *req; // For the output pipe of this request's job, NULL for a socket
+};
+
+struct pollset
+{
+    struct pollfd *fds;
+    struct mux_slot *slots;
+    int n, cap;
+};
 
-    listen_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_sock < 0)
+static void pollset_add(struct pollset *ps, int fd, short events, struct conn *c, struct request *r)
+{
+    if (ps->n == ps->cap)
     {
-        perror("Socket failed");
-        exit(EXIT_FAILURE);
+        ps->cap = ps->cap ? 2 * ps->cap : 64;
+        ps->fds = realloc(ps->fds, ps->cap * sizeof(struct pollfd));
+        ps->slots = realloc(ps->slots, ps->cap * sizeof(struct mux_slot));
+        if (ps->fds == NULL || ps->slots == NULL)
+        {
+            perror("Out of memory for poll set");
+            exit(EXIT_FAILURE);
+        }
     }
+    ps->fds[ps->n].fd = fd;
+    ps->fds[ps->n].events = events;
+    ps->fds[ps->n].revents = 0;
+    ps->slots[ps->n].conn = c;
+    ps->slots[ps->n].req = r;
+    ps->n++;
+}
 
-    // Sets socket to be reusable
-    rc = setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
-    if (rc < 0)
+static void pollset_remove(struct pollset *ps, int i)
+{
+    ps->n--;
+    ps->fds[i] = ps->fds[ps->n];
+    ps->slots[i] = ps->slots[ps->n];
+}
+
+/*
+ * Run request `r`'s job in a child process. The child writes the size of
+ * the result and then the result to a pipe, and exits. The pipe is watched
+ * in the poll set until the size arrives, then spliced to the client socket.
+ */
+static int muxbasic_spawn(struct request *r, struct pollset *ps)
+{
+    int pfd[2];
+    if (pipe2(pfd, O_CLOEXEC) == -1)
     {
-        perror("Set socket options failed.\n");
-        close(listen_sock);
-        exit(EXIT_FAILURE);
+        perror("Cannot create job pipe");
+        return -1;
     }
 
-    // Set to nonblocking
-    rc = ioctl(listen_sock, FIONBIO, (char *)&on);
-    if (rc < 0)
+    pid_t pid = fork();
+    if (pid < 0)
     {
-        perror("IO control failed");
-        close(listen_sock);
-        exit(EXIT_FAILURE);
+        perror("Cannot fork job");
+        close(pfd[0]);
+        close(pfd[1]);
+        return -1;
+    }
+    if (pid == 0) // Child process
+    {
+        // Do not keep other clients' sockets and jobs open while the job runs
+        for (int i = 0; i < ps->n; i++)
+        {
+            close(ps->fds[i].fd);
+        }
+        close(pfd[0]);
+
+        r->job.run(&r->job);
+
+        uint64_t size = r->result_len;
+        if (write(pfd[1], &size, sizeof(size)) != sizeof(size) ||
+            pipe_data(pfd[1], r->result, r->result_len) == -1)
+        {
+            _exit(EXIT_FAILURE);
+        }
+        _exit(EXIT_SUCCESS);
     }
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port);
+    close(pfd[1]);
+    fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+    fcntl(pfd[0], F_SETPIPE_SZ, 1024 * 1024); // Fewer wakeups; keeps the default if refused
+    r->result_fd = pfd[0];
+    pollset_add(ps, pfd[0], POLLIN, r->conn, r);
+    return 0;
+}
 
-    rc = bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr));
-    if (rc < 0)
+/*
+ * Drive connection `c` as far as its socket allows, forking a child for
+ * each job. Returns -1 if the connection should be closed.
+ */
+static int muxbasic_service(struct conn *c, struct pollset *ps)
+{
+    struct request *r;
+    while (1)
     {
-        perror("Bind failed");
-        close(listen_sock);
-        exit(EXIT_FAILURE);
+        int rc = conn_read(c, &r);
+        if (rc == CONN_CLOSE)
+        {
+            return -1;
+        }
+        if (rc == CONN_JOB)
+        {
+            if (muxbasic_spawn(r, ps) < 0)
+            {
+                conn_job_done(r); // Answered with an empty result
+            }
+            continue;
+        }
+
+        rc = conn_write(c);
+        if (rc == CONN_CLOSE)
+        {
+            return -1;
+        }
+        if (rc != CONN_READY)
+        {
+            break;
+        }
     }
 
-    // Listen to descriptor and set queue to 16.
-    rc = listen(listen_sock, 16);
-    if (rc < 0)
+    // Splicing ran dry: watch the pipe until the child writes more
+    r = c->head;
+    if (r != NULL && r->pipe_empty && !r->pipe_watched)
     {
-        perror("Listen failed");
-        close(listen_sock);
-        exit(EXIT_FAILURE);
+        r->pipe_watched = 1;
+        c->jobs++;
+        pollset_add(ps, r->result_fd, POLLIN, c, r);
     }
+    return 0;
+}
 
-    memset(fds, 0, sizeof(fds));
-    fds[0].fd = listen_sock;
-    fds[0].events = POLLIN;
+/*
+ * Drop muxbasic connection `c`. If pipe slots still refer to it, the last
+ * of them frees it.
+ */
+static void muxbasic_close(struct conn *c)
+{
+    if (c->jobs > 0)
+    {
+        close(c->fd);
+        c->fd = -1;
+        c->dead = 1;
+    }
+    else
+    {
+        conn_free(c);
+    }
+}
 
-    // The program will end if no activity for 5 min
-    timeout = (5 * 60 * 1000);
+/*
+ * Muxbasic: a single poll() loop over non-blocking connections (see conn_util.c).
+ * Jobs run in child processes, so the loop itself never blocks.
+ */
+void run_with_muxbasic(int port, char cwd[], int binary)
+{
+    struct pollset ps = {0};
+    int client_num = 0;
 
-    do
-    {
-        printf("Polling for client...\n");
-        rc = poll(fds, nfds, timeout);
+    raise_fd_limit();
+    int listen_sock = open_listener(port, 1);
+    pollset_add(&ps, listen_sock, POLLIN, NULL, NULL);
+    printf("Listening for clients...\n");
 
-        if (rc < 0)
+    while (1)
+    {
+        // Only ask for what each connection can use right now
+        for (int i = 0; i < ps.n; i++)
         {
-            perror("Poll failed");
-            break;
+            struct conn *c = ps.slots[i].conn;
+            if (c != NULL && ps.slots[i].req == NULL)
+            {
+                ps.fds[i].events = (conn_wants_read(c) ? POLLIN : 0) | (conn_wants_write(c) ? POLLOUT : 0);
+            }
         }
 
-        if (rc == 0)
+        int rc = poll(ps.fds, ps.n, -1);
+        if (rc < 0)
         {
-            printf("Poll timed out.\n");
+            if (errno == EINTR)
+                continue;
+            perror("Poll failed");
             break;
         }
 
-        current_size = nfds;
-        for (i = 0; i < current_size; i++)
+        // Walk backwards so that removing entry i only moves an already handled one into place
+        for (int i = ps.n - 1; i >= 0; i--)
         {
-            if (fds[i].revents == 0)
+            short revents = ps.fds[i].revents;
+            struct conn *c = ps.slots[i].conn;
+            struct request *r = ps.slots[i].req;
+            if (revents == 0)
             {
                 continue;
             }
-            if (fds[i].revents != POLLIN)
+            ps.fds[i].revents = 0;
+
+            if (c == NULL)
             {
-                printf("Error, revents.\n");
-                end_server = 1;
-                break;
+                // Accept everything in the queue
+                int sd;
+                while ((sd = accept4(listen_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                {
+                    struct conn *nc = conn_new(sd, ++client_num, cwd, binary);
+                    if (nc == NULL)
+                    {
+                        close(sd);
+                        continue;
+                    }
+                    printf("Connected with client %d\n", client_num);
+                    pollset_add(&ps, sd, POLLIN, nc, NULL);
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+                {
+                    perror("Accept failed");
+                }
             }
-            if (fds[i].fd == listen_sock)
+            else if (r != NULL)
             {
-                do
+                if (r->pipe_watched)
+                {
+                    // The child wrote more of the result being spliced
+                    c->jobs--;
+                    r->pipe_empty = r->pipe_watched = 0;
+                }
+                else
                 {
-                    new_sock = accept(listen_sock, NULL, NULL);
+                    // A job's result size arrived, or its child failed
+                    int size_rc = c->dead ? -1 : conn_read_result_size(r);
+                    if (size_rc == 0)
+                    {
+                        continue;
+                    }
+                    if (size_rc < 0)
+                    {
+                        close(r->result_fd);
+                        r->result_fd = -1;
+                    }
+                    conn_job_done(r);
+                }
+                pollset_remove(&ps, i);
 
-                    // This error-catch should exclude EWOULDBLOCK since if this error
-                    // is encountered we've accepted all of the descriptors in queue.
-                    // Any other error should cause the server to exit.
-                    if (new_sock < 0)
+                if (c->dead)
+                {
+                    if (c->jobs == 0)
                     {
-                        if (errno != EWOULDBLOCK)
-                        {
-                            perror("Accept failed");
-                            end_server = 1;
-                        }
-                        break;
+                        conn_free(c);
                     }
-                    printf("New connection.\n");
-                    fds[nfds].fd = new_sock;
-                    fds[nfds].events = POLLIN;
-                    nfds++;
-                } while (new_sock != -1);
+                }
+                else if (muxbasic_service(c, &ps) < 0)
+                {
+                    // The socket slot is found and dropped on the next hangup or error event
+                    shutdown(c->fd, SHUT_RDWR);
+                }
             }
             else
             {
-                // If we're in this else statement, it means this is not the listening socket.
-                printf("This descriptor is readable: %d\n", fds[i].fd);
-                close_conn = 0;
-                int solution_num = 0;
-                client_num++;
+                if (!(revents & (POLLERR | POLLHUP | POLLNVAL)) && muxbasic_service(c, &ps) == 0)
+                {
+                    continue;
+                }
+                pollset_remove(&ps, i);
+                muxbasic_close(c);
+            }
+        }
+    }
+
+    // Clean up open sockets
+    for (int i = 0; i < ps.n; i++)
+    {
+        close(ps.fds[i].fd);
+    }
+    free(ps.fds);
+    free(ps.slots);
+}
+
+/*
+ * Drop a muxscale connection: close the socket now, but only queue the
+ * struct on `graveyard`. Later events of the same epoll_wait() batch may
+ * still point to it, and running jobs refer to it until they come back.
+ */
+static void muxscale_close(struct conn *c, struct conn **graveyard)
+{
+    if (c->dead)
+    {
+        return;
+    }
+    close(c->fd);
+    c->fd = -1;
+    __atomic_store_n(&c->dead, 1, __ATOMIC_RELAXED); // Queued jobs are skipped
+    if (c->jobs == 0)
+    {
+        c->next = *graveyard;
+        *graveyard = c;
+    }
+}
+
+/*
+ * Drive connection `c` as far as its socket allows.
+ * Returns -1 if the connection should be closed.
+ */
+static int muxscale_service(struct conn *c, struct pool *pool)
+{
+    struct request *r;
+    while (1)
+    {
+        int rc = conn_read(c, &r);
+        if (rc == CONN_CLOSE)
+        {
+            return -1;
+        }
+        if (rc == CONN_JOB)
+        {
+            pool_submit(pool, &r->job);
+            continue; // Pipelined requests run side by side
+        }
+
+        rc = conn_write(c);
+        if (rc == CONN_CLOSE)
+        {
+            return -1;
+        }
+        if (rc != CONN_READY)
+        {
+            return 0;
+        }
+        // Result sent, the next command may already be waiting in the socket
+    }
+}
+
+/*
+ * Muxscale: edge-triggered epoll event loop.
+ * Connections are non-blocking state machines (see conn_util.c), jobs are run
+ * by a fixed pool of `workers` compute threads (one per CPU if < 1).
+ */
+void run_with_muxscale(int port, char cwd[], int workers, int binary)
+{
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct pool pool;
+    struct conn *graveyard = NULL;
+    int client_num = 0;
+
+    raise_fd_limit();
+    int listen_sock = open_listener(port, 1);
+    pool_init(&pool, workers);
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+    {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
 
-                do
+    // The listening socket and the pool's eventfd are told apart from connections by their data pointer
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &listen_sock;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_sock, &ev) == -1)
+    {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &pool;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, pool.event_fd, &ev) == -1)
+    {
+        perror("epoll_ctl failed");
+        exit(EXIT_FAILURE);
+    }
+    printf("Listening for clients (%d workers)...\n", pool.nthreads);
+
+    while (1)
+    {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == &listen_sock)
+            {
+                // Accept everything in the queue, edge-triggered will not tell us again
+                while (1)
                 {
-                    // Here we do the work we want to perform.
-                    // ##############################################################
-                    solution_num++;
-
-                    char msg[BUF_SIZE];
-                    memset(msg, 0, sizeof(msg));
-                    rc = recv(fds[i].fd, msg, sizeof(msg), 0);
-                    if (rc < 0)
+                    int sd = accept4(listen_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (sd < 0)
                     {
-                        if (errno != EWOULDBLOCK)
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
                         {
-                            perror("Client closed");
-                            close_conn = 1;
+                            perror("Accept failed");
                         }
+                        if (errno == EINTR || errno == ECONNABORTED)
+                            continue;
                         break;
                     }
 
-                    char cmd[7]; // "kmeans" or "matinv"
-                    snprintf(cmd, sizeof(cmd), "%.6s", msg);
-                    printf("Client %d commanded: %s\n", client_num, msg);
-
-                    if (strcmp(cmd, "matinv") != 0 && strcmp(cmd, "kmeans") != 0)
+                    struct conn *c = conn_new(sd, ++client_num, cwd, binary);
+                    if (c == NULL)
                     {
-                        // Send error message to client
-                        char error[] = "Error! Valid commands: 'matinv' or 'kmeans'";
-                        send(fds[i].fd, error, sizeof(error), 0);
-                        close(fds[i].fd);
-                        exit(EXIT_FAILURE);
+                        close(sd);
+                        continue;
                     }
+                    printf("Connected with client %d\n", client_num);
 
-                    // Generate solution filename
-                    char data[30];
-                    snprintf(data, sizeof(data), "%s_client%d_soln%d.txt", cmd, client_num, solution_num);
-                    printf("Sending solution: %s\n", data);
-
-                    // Send solution filename to client
-                    if (send(fds[i].fd, data, strlen(data), 0) == -1)
+                    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    ev.data.ptr = c;
+                    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sd, &ev) == -1)
                     {
-                        perror("Error sending filename");
-                        exit(EXIT_FAILURE);
+                        perror("epoll_ctl failed");
+                        conn_free(c);
                     }
-
-                    // Run kmeans_run or matinv_run based on msg.
-                    char command[PATH_SIZE];
-                    snprintf(command, PATH_SIZE, "%s/%s", cwd, msg);
-                    printf("Execute args: (%s, %s, %d, %d)\n", command, cwd, client_num, solution_num);
-                    if (strcmp(cmd, "kmeans") == 0)
+                }
+            }
+            else if (events[i].data.ptr == &pool)
+            {
+                struct job *job = pool_take_done(&pool);
+                while (job != NULL)
+                {
+                    struct job *next = job->next;
+                    struct request *r = (struct request *)job->arg;
+                    struct conn *c = r->conn;
+                    conn_job_done(r);
+                    if (!c->dead)
                     {
-                        kmeans_run(fds[i].fd, command, cwd, client_num, solution_num);
+                        if (muxscale_service(c, &pool) < 0)
+                            muxscale_close(c, &graveyard);
                     }
-                    else if (strcmp(cmd, "matinv") == 0)
+                    else if (c->jobs == 0)
                     {
-                        matinv_run(fds[i].fd, command, cwd, client_num, solution_num);
+                        c->next = graveyard;
+                        graveyard = c;
                     }
-
-                    // ##############################################################
-                } while (1);
-
-                if (close_conn)
-                {
-                    close(fds[i].fd);
-                    fds[i].fd = -1;
-                    compress_array = 1;
+                    job = next;
                 }
             }
-        }
-
-        if (compress_array)
-        {
-            compress_array = 0;
-            for (i = 0; i < nfds; i++)
+            else
             {
-                if (fds[i].fd == -1)
+                struct conn *c = (struct conn *)events[i].data.ptr;
+                if (c->dead)
                 {
-                    for (j = i; j < nfds; j++)
-                    {
-                        fds[j].fd = fds[j + 1].fd;
-                    }
-                    i--;
-                    nfds--;
+                    continue;
+                }
+                if ((events[i].events & (EPOLLERR | EPOLLHUP)) || muxscale_service(c, &pool) < 0)
+                {
+                    muxscale_close(c, &graveyard);
                 }
             }
         }
-    } while (end_server == 0);
 
-    // Clean up open sockets
-    for (i = 0; i < nfds; i++)
-    {
-        if (fds[i].fd >= 0)
+        while (graveyard != NULL)
         {
-            close(fds[i].fd);
+            struct conn *next = graveyard->next;
+            conn_free(graveyard);
+            graveyard = next;
         }
     }
-    */
-}
 
-void run_with_muxscale()
-{
-    printf("Muxscale not implemented\n");
-    exit(EXIT_NOT_IMPLEMENTED);
+    pool_destroy(&pool);
+    close(epfd);
+    close(listen_sock);
 }